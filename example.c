@@ -18,6 +18,17 @@
 #define SUCCESS         (0)
 #define GIF_ERROR       (60)
 
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+// Test animation written by 'a' and 'b': frames, size and delay
+#define ANIM_FRAMES     (24)
+#define ANIM_W          (128)
+#define ANIM_H          (64)
+#define ANIM_DELAY      (10)
+
+static void drawFrame(pixel *RGBframe, int w, int h, int n);
+
 
 
 /*---------------------------------------------------------------------------
@@ -41,16 +52,29 @@ int main(int argc, char *argv[]) {
    int palSize = MAX_PALETTE;
     
    // Check command line arguments
-    if ((argc != 3) && (argc != 4)){
+    if ((argc < 3) || (argc > 5)){
       fprintf(stderr, "This programs tests GIF reading and writing\n");
-      fprintf(stderr, "A duplicate PPM output file will also be produced\n");
-      fprintf(stderr, "%s r|w|c gifFile [gifFile2] \n", argv[0]);
+      fprintf(stderr, "'r' and 'w' also write a PPM copy, outr.ppm or outw.ppm\n");
+      fprintf(stderr, "%s r|w|c|s gifFile [gifFile2] \n", argv[0]);
+      fprintf(stderr, "%s s gifFile [WxH[@fps]] [rate]\n", argv[0]);
+      fprintf(stderr, "%s a gifFile [key|merge|lossy]\n", argv[0]);
+      fprintf(stderr, "%s k gifFile\n", argv[0]);
+      fprintf(stderr, "%s b gifFile bytes\n", argv[0]);
       fprintf(stderr, "Where: r|w       - read or write flags, required\n");
       fprintf(stderr, "       gifFile   - name of the file to read or write\n");
       fprintf(stderr, "       gifFile2  - optional 2nd file name for 'c' copy mode\n");
+      fprintf(stderr, "       WxH@fps   - 's' mode: raw RGB frame size and rate, Y4M if absent\n");
+      fprintf(stderr, "       rate      - 's' mode: optional output frames per second\n");
+      fprintf(stderr, "       key|merge|lossy - 'a' mode: encoder option for the test animation\n");
+      fprintf(stderr, "       bytes     - 'b' mode: most bytes the test animation may take\n");
       fprintf(stderr, "e.g: %s r test.gif   - produces a PPM file from test.gif file\n", argv[0]);
       fprintf(stderr, "     %s w test.gif   - produces a sample gif file\n", argv[0]);
-      fprintf(stderr, "     %s c in.gif out.gif  - copies in.gif to out.gif with full conversion\n", argv[0]);
+      fprintf(stderr, "     %s c in.gif out.gif  - copies every frame of in.gif to out.gif with full conversion\n", argv[0]);
+      fprintf(stderr, "     ffmpeg -i in.mp4 -f yuv4mpegpipe -pix_fmt yuv420p - | %s s out.gif 10\n", argv[0]);
+      fprintf(stderr, "     ffmpeg -i in.mp4 -f rawvideo -pix_fmt rgb24 - | %s s out.gif 320x240@30\n", argv[0]);
+      fprintf(stderr, "     %s a anim.gif key  - writes a test animation with keyframes\n", argv[0]);
+      fprintf(stderr, "     %s k anim.gif      - checks every seek against a sequential decode\n", argv[0]);
+      fprintf(stderr, "     %s b small.gif 8000 - fits the test animation in 8000 bytes\n", argv[0]);
       return(SYNTAX_ERROR);
     }
     
@@ -63,72 +87,242 @@ int main(int argc, char *argv[]) {
    Do stuff based on the flag.  Read the input GIF and write a new one out
    ------------------------------------------------------------------------*/
    if (strcmp(argv [1], "c") == 0) {
-      // Open the GIF file
-      inGif = gd_open_gif(argv[2]);
-      if (!inGif) {
-         fprintf(stderr, "Could not open %s\n", argv[2]);
+      ge_Transcode tc;
+
+      if (argc != 4) {
+         fprintf(stderr, "Copy mode needs an output file\n");
          return(SYNTAX_ERROR);
       }
-
-      printf("Reading %s %dx%d %d colors %d depth %d loop count\n", argv [2],
-             inGif->width, inGif->height, inGif->palette->size, inGif->depth, inGif->loop_count);
-    
-      // Get memory for a 3 color frame
-      RGBframe = malloc(inGif->width * inGif->height * 3);
-      if (!RGBframe ) {
-         fprintf(stderr, "Could not allocate frame\n");
+      // Default settings: full palettes, no dither, 4 frames between stages
+      memset(&tc, 0, sizeof(tc));
+      i = ge_transcode(argv [2], argv [3], &tc);
+      if (i == -1) {
+         fprintf(stderr, "Could not read %s\n", argv[2]);
+         return(GIF_ERROR);
+      }
+      if (i == -2) {
+         fprintf(stderr, "Out of memory\n");
          return(MALLOC_ERROR);
       }
+      if (i < 0) {
+         fprintf(stderr, "Could not create %s gif file\n", argv [3]);
+         return(GIF_ERROR);
+      }
+      printf("Writing %s with %d frames, %d new palettes, loop %d\n", argv [3],
+             tc.nframes, tc.requantized, tc.loop);
+      printf("%ld -> %ld bytes in %.3f s, %.1f frames/s, %.2f MB/s\n",
+             tc.bytes_in, tc.bytes_out, tc.seconds, tc.nframes / MAX(tc.seconds, 1e-9),
+             tc.bytes_in / MAX(tc.seconds, 1e-9) / 1e6);
+      printf("Peak memory: %ld KB of frames, %ld KB resident\n",
+             tc.peak_frames / 1024, tc.peak_rss);
+   } // copy 
+    
+    
+   /*------------------------------------------------------------------------
+     Encode raw RGB or Y4M video read from stdin
+   ------------------------------------------------------------------------*/
+   else if (strcmp(argv [1], "s") == 0) {
+      ge_Stream gs;
 
-      // Get the first frame from the GIF
-      i = gd_get_frame(inGif);
-      if (i == -1) { 
-         fprintf(stderr, "GIF error\n");
-         exit(GIF_ERROR);
+      memset(&gs, 0, sizeof(gs));
+      for (i = 3; i < argc; i++) {
+         // A frame size says the input is raw RGB, a lone number is the rate
+         if (strchr(argv [i], 'x')) {
+            if (sscanf(argv [i], "%dx%d@%lf", &gs.width, &gs.height, &gs.fps) < 2) {
+               fprintf(stderr, "Bad frame size %s\n", argv [i]);
+               return(SYNTAX_ERROR);
+            }
          }
-      
-      // Render it to RBG
-      gd_render_frame(inGif, (uint8_t *)RGBframe);
-      
-      if (i == 0) { 
-         gd_rewind(inGif);
+         else {
+            gs.rate = atof(argv [i]);
          }
-
-      // output the same as input
-      w = inGif->width;
-      h = inGif->height;
- 
-      // Write out the wedge as a ppm
-      writePPM("outc.ppm", w, h, RGBframe);      
-      
-      //Get space for the index color array
-      IndxFrame = malloc(h*w*sizeof(uint8_t));   
+      }
+      i = ge_encode_stream(0, argv [2], &gs);
+      if (i == -2) {
+         fprintf(stderr, "Out of memory\n");
+         return(MALLOC_ERROR);
+      }
+      if (i == -3) {
+         fprintf(stderr, "Could not create %s gif file\n", argv [2]);
+         return(GIF_ERROR);
+      }
+      if (i == -1 && gs.nframes == 0) {
+         fprintf(stderr, "Could not read the video stream\n");
+         return(GIF_ERROR);
+      }
+      if (i == -1) {
+         fprintf(stderr, "The video stream ends inside a frame\n");
+      }
+      printf("Writing %s with %d of %d frames, %d palettes, %.2f fps\n", argv [2],
+             gs.nframes, gs.frames_in, gs.palettes, gs.rate > 0 ? MIN(gs.rate, gs.fps) : gs.fps);
+      printf("%ld -> %ld bytes in %.3f s, %.1f frames/s, %.2f MB/s\n",
+             gs.bytes_in, gs.bytes_out, gs.seconds, gs.frames_in / MAX(gs.seconds, 1e-9),
+             gs.bytes_in / MAX(gs.seconds, 1e-9) / 1e6);
+      printf("Peak memory: %ld KB of frames, %ld KB resident\n",
+             gs.peak_frames / 1024, gs.peak_rss);
+   } // stream
     
-      // Build a complete index color file from the true color file
-      palSize = createGIF(RGBframe, IndxFrame, w, h, palette, palSize);
-      printf("Writing %s with %d colors\n", argv[3], palSize);
     
-      //                   file name    canvas size    palette  palette depth  infinite loop 
-      outGif = ge_new_gif2(argv [3], w, h, (uint8_t *)palette, palSize, 0);
+   /*------------------------------------------------------------------------
+     Write a test animation with one encoder option and read it back
+   ------------------------------------------------------------------------*/
+   else if (strcmp(argv [1], "a") == 0) {
+      ge_Options opt;
+      uint8_t *index[2];
+      int merged, images = 0;
+      long total = 0;
+
+      memset(&opt, 0, sizeof(opt));
+      if (argc == 4 && strcmp(argv [3], "key") == 0) {
+         opt.keyframe = 8;
+      }
+      else if (argc == 4 && strcmp(argv [3], "merge") == 0) {
+         opt.merge = 1;
+      }
+      else if (argc == 4 && strcmp(argv [3], "lossy") == 0) {
+         opt.lossy = 32;
+      }
+      else if (argc != 3) {
+         fprintf(stderr, "Unknown option %s\n", argv [3]);
+         return(SYNTAX_ERROR);
+      }
+      w = ANIM_W;
+      h = ANIM_H;
+      // Two index frames in turn: the encoder diffs against the one before
+      RGBframe = malloc(w * h * sizeof(pixel));
+      index[0] = malloc(w * h);
+      index[1] = malloc(w * h);
+      if (!RGBframe || !index[0] || !index[1]) {
+         fprintf(stderr, "Could not allocate frame\n");
+         return(MALLOC_ERROR);
+      }
+      outGif = ge_new_gif_opt(argv [2], w, h, (uint8_t *)ge_palette256, 8, 0, &opt);
       if (outGif == NULL) {
          fprintf(stderr, "Could not create %s gif file\n", argv [2]);
-         exit(GIF_ERROR);
+         return(GIF_ERROR);
       }
-      outGif->frame = IndxFrame;
-
-      // add frame, 10 second delay
-      ge_add_frame(outGif, 0);
-       
-      /* remember to close the GIF */
+      for (k = 0; k < ANIM_FRAMES; k++) {
+         // Every fourth frame repeats the one before
+         drawFrame(RGBframe, w, h, k % 4 == 3 ? k - 1 : k);
+         pallatize256_buf((uint8_t *)RGBframe, 3 * w, w, h, index[k & 1]);
+         ge_add_frame_buf(outGif, index[k & 1], ANIM_DELAY);
+      }
+      merged = outGif->nmerged;
       ge_close_gif(outGif);
+      free(RGBframe);
+      free(index[0]);
+      free(index[1]);
+
+      // Merged frames pass their delay on, so the running time is the same
+      inGif = gd_open_gif(argv [2]);
+      if (!inGif) {
+         fprintf(stderr, "Could not open %s\n", argv [2]);
+         return(GIF_ERROR);
+      }
+      while ((i = gd_get_frame(inGif)) == 1) {
+         images++;
+         total += inGif->gce.delay;
+      }
+      gd_close_gif(inGif);
+      printf("Writing %s with %d of %d frames, %d merged, %.2f s\n", argv [2],
+             images, ANIM_FRAMES, merged, total / 100.0);
+      if (i < 0 || images + merged != ANIM_FRAMES || total != ANIM_FRAMES * ANIM_DELAY) {
+         fprintf(stderr, "%s does not read back as written\n", argv [2]);
+         return(GIF_ERROR);
+      }
+   } // animation
+
+
+   /*------------------------------------------------------------------------
+     Seek to every image and compare it with a sequential decode
+   ------------------------------------------------------------------------*/
+   else if (strcmp(argv [1], "k") == 0) {
+      uint8_t *seq, *more;
+      size_t size;
+      int n = 0, key, errors = 0;
+
+      inGif = gd_open_gif(argv[2]);
+      if (!inGif) {
+         fprintf(stderr, "Could not open %s\n", argv[2]);
+         return(SYNTAX_ERROR);
+      }
+      size = (size_t)inGif->width * inGif->height * 3;
+      seq = NULL;
+      while (gd_get_frame(inGif) == 1) {
+         more = realloc(seq, (n + 1) * size);
+         if (!more) {
+            fprintf(stderr, "Could not allocate frame\n");
+            return(MALLOC_ERROR);
+         }
+         seq = more;
+         gd_render_frame(inGif, &seq[n * size]);
+         n++;
+      }
+      RGBframe = malloc(size);
+      if (!RGBframe) {
+         fprintf(stderr, "Could not allocate frame\n");
+         return(MALLOC_ERROR);
+      }
+      for (i = 0; i < n; i++) {
+         key = gd_seek(inGif, i);
+         if (key < 0) {
+            fprintf(stderr, "%s has no seek index\n", argv[2]);
+            return(GIF_ERROR);
+         }
+         // From the keyframe on, the canvas builds up as it did in order
+         for (j = key; j <= i; j++) {
+            gd_get_frame(inGif);
+         }
+         gd_render_frame(inGif, (uint8_t *)RGBframe);
+         if (memcmp(RGBframe, &seq[i * size], size) != 0) {
+            errors++;
+         }
+      }
+      printf("Seeking %s: %d images, %d keyframes, %d differ from a sequential decode\n",
+             argv [2], n, inGif->nseek, errors);
       gd_close_gif(inGif);
-       
-      // Clean up memory
       free(RGBframe);
-      free(IndxFrame);
-   } // copy 
-    
-    
+      free(seq);
+      if (errors) {
+         return(GIF_ERROR);
+      }
+   } // seek
+
+
+   /*------------------------------------------------------------------------
+     Fit the test animation in a byte budget
+   ------------------------------------------------------------------------*/
+   else if (strcmp(argv [1], "b") == 0) {
+      pixel *frames[ANIM_FRAMES];
+      ge_Budget bud;
+      long budget, bytes;
+
+      if (argc != 4 || (budget = atol(argv [3])) <= 0) {
+         fprintf(stderr, "Budget mode needs a size in bytes\n");
+         return(SYNTAX_ERROR);
+      }
+      for (k = 0; k < ANIM_FRAMES; k++) {
+         frames[k] = malloc(ANIM_W * ANIM_H * sizeof(pixel));
+         if (!frames[k]) {
+            fprintf(stderr, "Could not allocate frame\n");
+            return(MALLOC_ERROR);
+         }
+         drawFrame(frames[k], ANIM_W, ANIM_H, k);
+      }
+      bytes = ge_encode_budget(argv [2], frames, ANIM_FRAMES, ANIM_W, ANIM_H, NULL, 0,
+                               budget, &bud);
+      for (k = 0; k < ANIM_FRAMES; k++) {
+         free(frames[k]);
+      }
+      if (bytes < 0 || bytes > budget) {
+         fprintf(stderr, "Could not fit %s in %ld bytes\n", argv [2], budget);
+         return(GIF_ERROR);
+      }
+      printf("Writing %s in %ld of %ld bytes: %d colors, lossy %d, 1 of %d frames, %d passes\n",
+             argv [2], bytes, budget, bud.palSize, bud.lossy, bud.decimate, bud.passes);
+   } // budget
+
+
    /*------------------------------------------------------------------------
      Build and write a GIF file and copy a PNG
    ------------------------------------------------------------------------*/
@@ -186,10 +380,8 @@ int main(int argc, char *argv[]) {
          exit(GIF_ERROR);
       }
          
-      outGif->frame = IndxFrame;
-
-      // add frame, 10 second delay
-      ge_add_frame(outGif, 0);
+      // add the caller owned frame, no delay
+      ge_add_frame_buf(outGif, IndxFrame, 0);
        
       /* remember to close the GIF */
       ge_close_gif(outGif);
@@ -290,5 +482,29 @@ void writePPM(const char *filename, int x, int y, pixel *img) {
 }
 
 
+/*---------------------------------------------------------------------------
+   Draws frame n of the test animation: the color wedge of 'w' mode with a
+   white square moving 4 pixels a frame across it
 
+      pixel *RGBframe - receives the w*h frame
+      int w, h        - frame size
+      int n           - frame number
 
+      Returns: nothing
+----------------------------------------------------------------------------*/
+static void drawFrame(pixel *RGBframe, int w, int h, int n) {
+   int i, j, x = 4 * n % (w - 16);
+
+   for (i = 0; i < h; i++) {
+      for (j = 0; j < w; j++) {
+         RGBframe[i * w + j].r = i + j;
+         RGBframe[i * w + j].g = i - j;
+         RGBframe[i * w + j].b = j - i;
+      }
+   }
+   for (i = 24; i < 40 && i < h; i++) {
+      for (j = x; j < x + 16; j++) {
+         RGBframe[i * w + j].r = RGBframe[i * w + j].g = RGBframe[i * w + j].b = 255;
+      }
+   }
+}
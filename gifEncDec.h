@@ -23,6 +23,233 @@ typedef struct { uint8_t r; uint8_t g; uint8_t b; } pixel;
 #define  S_MASK_HIGH  (0x80)
 typedef struct { uint8_t h; uint8_t s; uint8_t v; } hsvPixel;
 
+/* Dirty-rectangle search: the canvas is diffed in GE_TILE x GE_TILE tiles and
+ * at most GE_MAX_RECTS image descriptors are written per animation frame. */
+#define GE_TILE       (16)
+#define GE_MAX_RECTS  (8)
+
+/* Exact color histogram: an open addressing hash table over 24 bit colors.
+ * colors[] and counts[] are in order of first appearance; a color is stored
+ * as r << 16 | g << 8 | b. */
+typedef struct ge_Histogram {
+    int size;           /* number of distinct colors */
+    int cap;            /* allocated entries in colors/counts */
+    int bits;           /* hash table has 1 << bits slots */
+    int32_t *slots;     /* color index + 1, 0 for an empty slot */
+    uint32_t *colors;
+    uint32_t *counts;
+} ge_Histogram;
+
+/* Color spaces the quantizer can work in.  GE_SPACE_DEFAULT, the zero of
+ * a cleared struct, is RGB, or HSV when gifenc.c has HSV_MODE; the low level
+ * functions taking a space treat it as RGB. */
+#define GE_SPACE_DEFAULT (0)
+#define GE_SPACE_HSV   (1)  /* packed hsvPixel values, see RGBtoHSV() */
+#define GE_SPACE_OKLAB (2)  /* RGB keys, quantized and matched in OKLab */
+#define GE_SPACE_RGB   (3)
+
+/* Integer OKLab coordinates are scaled by this: L runs 0..GE_OKLAB_SCALE. */
+#define GE_OKLAB_SCALE (1000.0f)
+
+/* Inverse colormap: the nearest palette entry for every 5/6/5 bit RGB cell,
+ * so a pixel maps to its index with one lookup. ge_invmap_set() rebuilds the
+ * table only when the palette changes, so one map can be kept across frames. */
+#define GE_INV_INDEX(p)  ((((p).r >> 3) << 11) | (((p).g >> 2) << 5) | ((p).b >> 3))
+
+typedef struct ge_InvMap {
+    int ncolors;                /* palette entries, 0 before the first build */
+    int space;                  /* GE_SPACE_RGB or GE_SPACE_OKLAB distances */
+    uint8_t palette[0x300];     /* palette the table was built for */
+    uint8_t table[32 * 64 * 32];
+} ge_InvMap;
+
+/* Most threads ge_run_tasks() starts for one call. */
+#define GE_MAX_THREADS  (64)
+
+/* A unit of parallel work: called once for each index 0..ntasks-1. */
+typedef void (*ge_Task)(void *arg, int index);
+
+/* External thread pool hook: run task(arg, i) for every i in 0..ntasks-1, in
+ * any order and on any threads, and return when all of them are done. */
+typedef void (*ge_PoolRun)(void *pool, ge_Task task, void *arg, int ntasks);
+
+/* Dithering applied when pixels are mapped to a reduced palette. */
+#define GE_DITHER_NONE     (0)
+#define GE_DITHER_FS       (1)  /* Floyd-Steinberg error diffusion */
+#define GE_DITHER_ORDERED  (2)  /* 8x8 Bayer matrix */
+
+/* Source pixel layouts the quantizer reads directly, see ge_Source. */
+#define GE_FMT_RGB   (0)  /* packed pixel */
+#define GE_FMT_RGBA  (1)  /* 4 bytes per pixel */
+#define GE_FMT_BGRA  (2)  /* 4 bytes per pixel */
+#define GE_FMT_I420  (3)  /* Y plane, then U and V at half size, BT.601 video range */
+#define GE_FMT_PLANAR (4) /* R, G and B planes, see ge_Planar */
+
+/* Planar image: separate R, G and B planes.  Rows start on GE_PLANE_ALIGN
+ * byte boundaries and the stride is a multiple of it, so vector loops can
+ * work on whole registers of one channel. */
+#define GE_PLANE_ALIGN  (32)
+
+typedef struct ge_Planar {
+    int w, h;
+    int stride;                 /* bytes from a row to the next, each plane */
+    uint8_t *plane[3];          /* R, G and B */
+} ge_Planar;
+
+/* A frame as it comes from the capture side.  Rows are converted as they
+ * are read, so no converted copy of the frame is made.  With alpha_min > 0
+ * pixels whose alpha is below it take a transparent palette index of their
+ * own, the last one; formats without alpha then just reserve that index. */
+typedef struct ge_Source {
+    int format;                 /* GE_FMT_* */
+    const uint8_t *plane[3];    /* the pixels; Y, U and V planes for I420 */
+    int stride[3];              /* bytes per row of each plane, 0: tightly packed */
+    int alpha_min;              /* alpha below this is transparent, 0: opaque */
+} ge_Source;
+
+/* Options for createGIFex(). Zero-initialize; zero means the default. */
+typedef struct ge_QuantOpts {
+    ge_InvMap *invmap;  /* inverse colormap kept by the caller, NULL for one per call */
+    int fixed;          /* 1: use palette[0..palLen-1] as given, only map the pixels */
+    int dither;         /* GE_DITHER_* */
+    int space;          /* GE_SPACE_*, 0: GE_SPACE_DEFAULT */
+    int threads;        /* row bands worked on in parallel, 0 or 1 for one thread */
+    ge_PoolRun pool_run;/* optional external pool running the bands */
+    void *pool;         /* passed to pool_run */
+} ge_QuantOpts;
+
+/* One palette for a whole animation: frames are streamed into one histogram
+ * (optionally only 1 of every `every` frames), then ge_palette_build() makes
+ * the palette and its inverse colormap once and every frame is mapped to it. */
+typedef struct ge_PaletteBuilder {
+    ge_Histogram *hist; /* merged colors of the counted frames */
+    ge_InvMap *invmap;  /* built by ge_palette_build() */
+    int palLen;         /* palette size asked for */
+    int every;          /* count 1 of every `every` frames */
+    int nframes;        /* frames offered so far */
+    int ncolors;        /* palette entries, 0 until built */
+    int space;          /* GE_SPACE_*, set before the first frame is added */
+    int transparent;    /* a frame added had alpha, counted or skipped by
+                           every, so the last entry is reserved */
+    pixel palette[MAX_PALETTE];
+} ge_PaletteBuilder;
+
+/* Palette orders tried by ge_reorder_palette(). */
+#define GE_ORDER_AUTO      (0)  /* the smallest of the orders below */
+#define GE_ORDER_NONE      (1)  /* keep the current order */
+#define GE_ORDER_FREQ      (2)  /* most used first */
+#define GE_ORDER_LUMA      (3)  /* darkest first */
+#define GE_ORDER_HILBERT   (4)  /* along a 3D Hilbert curve through RGB */
+
+/* Compression levels, from fastest to smallest output. */
+#define GE_LEVEL_DEFAULT   (0)  /* same as GE_LEVEL_NORMAL */
+#define GE_LEVEL_STORE     (1)  /* literal codes only, no dictionary */
+#define GE_LEVEL_NORMAL    (2)  /* clear the dictionary as soon as it is full */
+#define GE_LEVEL_ADAPTIVE  (3)  /* keep a full dictionary until it stops paying */
+
+/* Encoder options for ge_new_gif_opt(). Zero-initialize, then set the fields
+ * of interest; zero always means the default. */
+typedef struct ge_Options {
+    int level;          /* GE_LEVEL_* */
+    int lossy;          /* 0: exact; else max color error (0..255 scale)
+                           allowed when extending an LZW match */
+    int transparent;    /* 0: none; else 1 + the transparent color index.
+                           Frames are then stored whole and disposed to the
+                           background, so clear pixels never show older ones */
+    int merge;          /* 0: off; else a frame with fewer than merge pixels
+                           changed is not written and its delay is added to
+                           the frame before it (1: identical frames only) */
+    int adapt;          /* 0: off; else frames changing less than a quarter
+                           of the canvas are merged the same way until the
+                           frame before has been shown adapt/100 s, less the
+                           more changed, lowering the rate of slow scenes */
+    int keyframe;       /* 0: off; else every keyframe-th frame, and any
+                           frame changing half the canvas, is stored whole
+                           and ge_close_gif() writes a seek index */
+    int memory;         /* 1: build the file in memory instead of writing
+                           fname, see ge_close_gif_mem() */
+    int rects;          /* 0: one image block per frame; else up to rects
+                           (at most GE_MAX_RECTS) blocks for distant changes,
+                           only timed right by decoders that composite
+                           zero-delay blocks, which browsers do not */
+} ge_Options;
+
+/* Seek index: a private application extension written before the trailer.
+ * Its sub-blocks hold GE_SEEK_ENTRY byte entries, each the image number
+ * (counting gd_get_frame() calls from 0), the time it shows in 1/100 s and
+ * the file offset of its first block, as little endian 32 bit numbers.  A
+ * last sub-block of 4 bytes holds the offset of the extension itself, so a
+ * reader finds it from the end of the file.  Other readers skip it. */
+#define GE_SEEK_APP    "GESEEKIX1.0"
+#define GE_SEEK_ENTRY  (12)
+
+/* Lossy mode: each palette entry keeps at most this many close colors to try
+ * when the exact next pixel does not extend the current match. */
+#define GE_LOSSY_NEAR  (8)
+
+/* Settings and results of ge_transcode(). Zero-initialize; zero means the
+ * default. */
+typedef struct ge_Transcode {
+    int palLen;         /* most colors per frame, 0 for MAX_PALETTE */
+    int depth;          /* frames queued between two stages, 0 for 4 */
+    int serial;         /* 1: run the stages in turn on the calling thread */
+    int merge_zero;     /* 1: merge images without a delay into the image
+                           after them, undoing frames split into rectangles;
+                           0 keeps every image as a frame of its own */
+    ge_QuantOpts quant; /* dither, space and threads for new palettes; an
+                           invmap given here is used and kept */
+    const uint8_t *data;/* the input in memory instead of inName, size bytes */
+    size_t size;
+    uint8_t *out;       /* out: with outName NULL, the output in memory,
+                           outSize bytes; free() it */
+    size_t outSize;
+    int keep_frames;    /* 1: frame buffers are kept in frames between calls
+                           and grown as needed; free() frames when done */
+    uint8_t *frames;
+    size_t framesSize;
+    ge_Options enc;     /* encoder options */
+    int nframes;        /* out: frames written */
+    int requantized;    /* out: frames that needed a new palette */
+    int loop;           /* out: loop count written, -1 for none */
+    long bytes_in;      /* out: input file size */
+    long bytes_out;     /* out: output file size */
+    double seconds;     /* out: wall clock time */
+    long peak_frames;   /* out: bytes held by frame buffers */
+    long peak_rss;      /* out: peak resident set of the process in KB, 0 if unknown */
+} ge_Transcode;
+
+/* Settings and results of ge_encode_stream(). Zero-initialize; zero means
+ * the default. */
+typedef struct ge_Stream {
+    int width, height;  /* raw RGB frame size, 0 to read a YUV4MPEG2 stream */
+    double fps;         /* input frame rate, 0: from the Y4M header or 25 */
+    double rate;        /* output frame rate, 0: keep every frame */
+    int palLen;         /* most colors per frame, 0 for MAX_PALETTE */
+    int refresh;        /* a new palette is made when a frame's mean squared
+                           error passes twice the palette's own plus this,
+                           0 for 64 */
+    int loop;           /* loop count, 0 forever, -1 for no loop */
+    ge_QuantOpts quant; /* dither, space and threads */
+    ge_Options enc;     /* encoder options */
+    int frames_in;      /* out: frames read */
+    int nframes;        /* out: frames written */
+    int palettes;       /* out: palettes made */
+    long bytes_in;      /* out: bytes of frame data read */
+    long bytes_out;     /* out: output file size */
+    double seconds;     /* out: wall clock time */
+    long peak_frames;   /* out: bytes held by frame buffers */
+    long peak_rss;      /* out: peak resident set of the process in KB, 0 if unknown */
+} ge_Stream;
+
+/* Settings chosen by ge_encode_budget(). */
+typedef struct ge_Budget {
+    int palSize;        /* colors per frame */
+    int lossy;          /* ge_Options.lossy used */
+    int decimate;       /* 1 of every decimate frames kept */
+    int passes;         /* full encodes needed */
+    long bytes;         /* final file size */
+} ge_Budget;
+
 // Decode
 typedef struct ge_GIF {
     uint16_t w, h;
@@ -30,7 +257,38 @@ typedef struct ge_GIF {
     int fd;
     int offset;
     int nframes;
-    uint8_t *frame, *back;
+    long nbytes;        /* bytes output so far */
+    uint8_t *mem;       /* ge_Options.memory: the file so far */
+    size_t memCap;      /* bytes allocated for mem */
+    int memErr;         /* mem could not grow, the file is incomplete */
+    int max_rects;      /* from ge_Options.rects, 1 for single-block frames;
+                           values above GE_MAX_RECTS are treated as
+                           GE_MAX_RECTS */
+    ge_Options opt;
+    uint16_t tw, th;    /* tile grid size */
+    const uint8_t *frame;   /* caller-owned frame to encode next */
+    const uint8_t *back;    /* caller-owned previous frame */
+    uint8_t *tiles;     /* one dirty flag per tile */
+    uint8_t *rows;      /* one changed flag per row, set by the frame diff */
+    uint8_t *prev;      /* merging: copy of the last frame written, else NULL */
+    uint8_t *pending;   /* merging: last frame merged with changes */
+    int has_pending;    /* pending is newer than prev */
+    uint16_t delay;     /* delay of the last frame written, merges included */
+    uint16_t pending_delay; /* delay the pending frame came with */
+    long delay_at;      /* file offset of that delay, -1 if it has no GCE */
+    int nmerged;        /* frames merged into the one before */
+    int nimages;        /* image blocks written */
+    long clock;         /* time the last frame written shows, in 1/100 s */
+    uint32_t *keys;     /* seek index entries, 3 numbers per keyframe */
+    int nkeys, capkeys;
+    int gct_depth;      /* global color table depth (entries = 1 << depth) */
+    int lct_depth;      /* local color table depth of this frame, 0 if none */
+    int ppal_depth;     /* color table depth of the previous frame */
+    uint8_t gct[0x300]; /* global color table */
+    uint8_t pal[0x300]; /* local color table of this frame */
+    uint8_t ppal[0x300];/* colors the previous frame was drawn with */
+    uint8_t nnear[0x100];                 /* lossy: number of close colors */
+    uint8_t near[0x100][GE_LOSSY_NEAR];   /* lossy: close colors, nearest first */
     uint32_t partial;
     uint8_t buffer[0xFF];
 } ge_GIF;
@@ -50,11 +308,15 @@ typedef struct gd_GCE {
 } gd_GCE;
 
 typedef struct gd_GIF {
-    int fd;
+    int fd;             /* -1 when decoding from memory */
+    const uint8_t *data;/* the file in memory, NULL to read fd */
+    size_t size;
+    off_t pos;          /* read position in data */
     off_t anim_start;
     uint16_t width, height;
     uint16_t depth;
     uint16_t loop_count;
+    int has_loop;       /* a NETSCAPE loop count was read */
     gd_GCE gce;
     gd_Palette *palette;
     gd_Palette lct, gct;
@@ -68,31 +330,117 @@ typedef struct gd_GIF {
     uint16_t fx, fy, fw, fh;
     uint8_t bgindex;
     uint8_t *canvas, *frame;
+    uint32_t *seek;     /* seek index, 3 numbers per keyframe as written */
+    int nseek;          /* keyframes in the seek index, 0 if none read */
 } gd_GIF;
 
 
 // Encode
 ge_GIF *ge_new_gif2(const char *fname, uint16_t width, uint16_t height, uint8_t *palette, 
                                     int depth, int loop);
+ge_GIF *ge_new_gif_opt(const char *fname, uint16_t width, uint16_t height,
+                       uint8_t *palette, int depth, int loop, const ge_Options *opt);
+/* Adds the frame gif->frame points at.  Breaking change: the handle no
+ * longer owns frame buffers and gif->frame is NULL until the caller sets it,
+ * so memcpy() into gif->frame no longer works; nothing is added while it is
+ * NULL.  See ge_add_frame_buf(). */
 void ge_add_frame(ge_GIF *gif, uint16_t delay);
+void ge_add_frame_buf(ge_GIF *gif, const uint8_t *frame, uint16_t delay);
+void ge_add_frame_lct(ge_GIF *gif, const uint8_t *frame, uint16_t delay,
+                      const uint8_t *palette, int ncolors);
+int ge_add_rgb_frame(ge_GIF *gif, pixel *RGBframe, uint8_t *IndxFrame,
+                     uint16_t delay, int palLen);
+long ge_encode_budget(const char *fname, pixel **frames, int nframes,
+                      uint16_t w, uint16_t h, const uint16_t *delays, int loop,
+                      long budget, ge_Budget *result);
 void ge_close_gif(ge_GIF* gif);
+uint8_t *ge_close_gif_mem(ge_GIF *gif, size_t *size);
+int ge_transcode(const char *inName, const char *outName, ge_Transcode *tc);
+int ge_encode_stream(int fd, const char *outName, ge_Stream *gs);
 uint8_t pallatize64( pixel pix );
 uint8_t pallatize256( pixel pix );
+void pallatize64_buf(const uint8_t *rgb, size_t stride, int w, int h, uint8_t *index);
+void pallatize256_buf(const uint8_t *rgb, size_t stride, int w, int h, uint8_t *index);
+extern const pixel ge_palette64[64];
+extern const pixel ge_palette256[256];
 int genPallette(pixel *image, int h, int w, int palSize, pixel *palette);
 int createGIF(pixel *RGBframe, uint8_t *IndxFrame, int w, int h, pixel *palette, int palLen);
+int createGIFex(pixel *RGBframe, uint8_t *IndxFrame, int w, int h, pixel *palette, int palLen,
+                const ge_QuantOpts *opt);
+int createGIFsrc(const ge_Source *src, uint8_t *IndxFrame, int w, int h, pixel *palette,
+                 int palLen, const ge_QuantOpts *opt);
+ge_PaletteBuilder *ge_palette_new(int palLen, int every);
+void ge_palette_free(ge_PaletteBuilder *pb);
+int ge_palette_add(ge_PaletteBuilder *pb, const pixel *RGBframe, int w, int h,
+                   const ge_QuantOpts *opt);
+int ge_palette_add_src(ge_PaletteBuilder *pb, const ge_Source *src, int w, int h,
+                       const ge_QuantOpts *opt);
+int ge_palette_build(ge_PaletteBuilder *pb);
+int ge_palette_map(ge_PaletteBuilder *pb, pixel *RGBframe, uint8_t *IndxFrame, int w, int h,
+                   const ge_QuantOpts *opt);
+int ge_palette_map_src(ge_PaletteBuilder *pb, const ge_Source *src, uint8_t *IndxFrame,
+                       int w, int h, const ge_QuantOpts *opt);
+int ge_reorder_palette(pixel *palette, int ncolors, uint8_t **frames, int nframes,
+                       int w, int h, int order);
+
+// Quantize
+ge_Histogram *ge_hist_new(void);
+void ge_hist_free(ge_Histogram *hist);
+void ge_hist_clear(ge_Histogram *hist);
+int ge_hist_insert(ge_Histogram *hist, uint32_t key, uint32_t count);
+int ge_hist_add(ge_Histogram *hist, const pixel *image, int npix, int limit);
+int ge_hist_find(const ge_Histogram *hist, pixel pix);
+int ge_quantize(const ge_Histogram *hist, int palLen, int space, pixel *palette,
+                uint8_t *map);
+ge_InvMap *ge_invmap_new(void);
+void ge_invmap_free(ge_InvMap *inv);
+int ge_invmap_set(ge_InvMap *inv, const pixel *palette, int ncolors);
+int ge_invmap_set_space(ge_InvMap *inv, const pixel *palette, int ncolors, int space);
+void ge_rgb_to_oklab(const pixel *rgb, int32_t *lab, int npix);
+void ge_invmap_apply(const ge_InvMap *inv, const pixel *image, uint8_t *index, int npix);
+int ge_hist_merge(ge_Histogram *dst, const ge_Histogram *src);
+void ge_run_tasks(const ge_QuantOpts *opt, ge_Task task, void *arg, int ntasks);
+void ge_dither_ordered(const ge_InvMap *inv, const pixel *image, uint8_t *index,
+                       int w, int y0, int y1);
+int ge_dither_fs(const ge_InvMap *inv, const pixel *image, uint8_t *index,
+                 int w, int h, const ge_QuantOpts *opt);
+const pixel *ge_source_row(const ge_Source *src, int w, int y, pixel *row, uint8_t *clear);
+int ge_dither_ordered_src(const ge_InvMap *inv, const ge_Source *src, uint8_t *index,
+                          int w, int y0, int y1, int tindex);
+int ge_dither_fs_src(const ge_InvMap *inv, const ge_Source *src, uint8_t *index,
+                     int w, int h, int tindex, const ge_QuantOpts *opt);
+
+// Planar images
+ge_Planar *ge_planar_new(int w, int h);
+void ge_planar_free(ge_Planar *img);
+void ge_planar_source(const ge_Planar *img, ge_Source *src);
+void ge_planar_rows(const ge_Source *src, int w, int y, const uint8_t *rows[3]);
+void ge_planar_pack(const uint8_t *r, const uint8_t *g, const uint8_t *b, int n, pixel *pix);
+void ge_planar_unpack(const pixel *pix, int n, uint8_t *r, uint8_t *g, uint8_t *b);
+void ge_invmap_apply_planar(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                            const uint8_t *b, uint8_t *index, int n);
+void ge_dither_row_planar(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                          const uint8_t *b, const int *off, uint8_t *index, int n);
+void ge_planar_lookup(const uint8_t *index, int n, const uint32_t *pal, int tindex,
+                      uint8_t *r, uint8_t *g, uint8_t *b);
 
 //Decode
 gd_GIF *gd_open_gif(const char *fname);
+gd_GIF *gd_open_gif_mem(const uint8_t *data, size_t size);
 int gd_get_frame(gd_GIF *gif);
 void gd_render_frame(gd_GIF *gif, uint8_t *buffer);
+void gd_render_frame_planar(gd_GIF *gif, ge_Planar *img);
 int gd_is_bgcolor(gd_GIF *gif, uint8_t color[3]);
 void gd_rewind(gd_GIF *gif);
+int gd_seek(gd_GIF *gif, int image);
 void gd_close_gif(gd_GIF *gif);
 
 // other
 void writePPM(const char *filename, int x, int y, pixel *img);
 pixel HSVtoRGB(hsvPixel  hsv);
 hsvPixel RGBtoHSV(pixel pix);
+void ge_rgb_to_hsv_buf(const pixel *rgb, hsvPixel *hsv, int npix);
+void ge_hsv_to_rgb_buf(const hsvPixel *hsv, pixel *rgb, int n);
 
 #endif /* GIFENCDEC_H */
 
@@ -0,0 +1,1134 @@
+/*---------------------------------------------------------------------------
+  Batch processing of GIF files.  Every GIF of a directory, or every file
+  named in a list, is probed, decoded to PPM, transcoded or turned into a
+  thumbnail on a pool of worker threads.  Files are dealt out to the workers
+  up front; a worker that runs out steals from the others, so a few large
+  files do not leave the rest of the pool idle.  Each worker keeps its
+  buffers and inverse colormap from one file to the next.
+
+  On Linux the file I/O goes through an io_uring per worker: while a file
+  is decoded and encoded, the opens and reads of the next ones and the
+  writes of the finished outputs run in the kernel, submitted together.
+  Without io_uring, or with -q 0, each job opens, reads and writes its
+  files itself.
+
+  gcc -O2 gifbatch.c gifenc.c gifdec.c rgb2hsv.c quantize.c planar.c transcode.c stream.c -lm -pthread -o gifbatch
+
+----------------------------------------------------------------------------*/
+#ifdef __linux__
+#define _GNU_SOURCE              // also syscall() and MAP_POPULATE for io_uring
+#else
+#define _POSIX_C_SOURCE 200809L  // strdup() and rand_r() under -std=c99
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "gifEncDec.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS    // openat, read, write and close are there
+#define GB_URING
+#endif
+#endif
+#endif
+
+#define SYNTAX_ERROR    (30)
+#define FILE_NOT_FOUND  (40)
+#define MALLOC_ERROR    (50)
+#define SUCCESS         (0)
+#define GIF_ERROR       (60)
+
+#define GB_THUMB        (128)    // default thumbnail size
+#define GB_LINE         (4096)   // longest path in a file list
+#define GB_DEPTH        (16)     // default files read ahead per worker
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* The jobs, in the order of their command names. */
+enum { JOB_PROBE, JOB_PPM, JOB_TRANSCODE, JOB_THUMB };
+static const char *jobNames[] = { "probe", "ppm", "transcode", "thumb" };
+
+/* One input file and what became of it. */
+typedef struct {
+   char *name;
+   long bytes;                   // input size
+   double seconds;               // time taken
+   int failed;
+} GbFile;
+
+/* Files waiting for a worker.  The owner takes from the tail, thieves from
+   the head, so they only meet on the last file. */
+typedef struct {
+   pthread_mutex_t lock;
+   int *items;
+   int head, tail;
+} GbDeque;
+
+/* The steps of a file read or written through the ring. */
+enum { IO_OPEN, IO_XFER, IO_CLOSE, IO_DONE };
+
+/* A file read or written through the ring.  Each has at most one request
+   in flight; its completion moves it on to the next step. */
+typedef struct {
+   int write;                    // an output, else an input
+   int state;
+   int file;                     // index in the batch
+   int fd;
+   char *name;                   // output path
+   uint8_t *buf;                 // the whole file
+   size_t size, done;
+   int err;
+   int busy;                     // a read-ahead slot in use
+   int pos;                      // its place in the owner's queue, -1 once taken
+   int stale;                    // the file was stolen, drop the read
+} GbIo;
+
+/* One io_uring: its rings mapped from the kernel. */
+typedef struct {
+   int fd;                       // -1 for blocking I/O
+#ifdef GB_URING
+   unsigned *sqHead, *sqTail, *sqMask, *sqArray, entries;
+   unsigned *cqHead, *cqTail, *cqMask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sqMap, *cqMap;
+   size_t sqLen, cqLen, sqesLen;
+#endif
+   unsigned queued;              // requests not yet submitted
+} GbRing;
+
+struct GbBatch;
+
+/* A worker and the context it reuses from file to file. */
+typedef struct {
+   struct GbBatch *batch;
+   pthread_t thread;
+   GbDeque queue;
+   unsigned seed;                // picks the workers to steal from
+   pixel *rgb;                   // decoded canvas
+   size_t rgbSize;
+   pixel *thumb;                 // thumbnail pixels and indexes
+   uint8_t *index;
+   ge_InvMap *invmap;
+   ge_Transcode tc;
+   int started;                  // the thread is running
+   int steals;
+   GbRing ring;
+   GbIo *reads;                  // depth slots for files read ahead
+   GbIo *in;                     // the file being worked on, NULL to read it
+   int writes;                   // outputs not yet on disk
+} GbWorker;
+
+/* The whole run. */
+typedef struct GbBatch {
+   int job;
+   const char *outDir;
+   int thumbSize;
+   int depth;                    // files read ahead, 0 for blocking I/O
+   GbFile *files;
+   int nfiles;
+   GbWorker *workers;
+   int nworkers;
+   pthread_mutex_t print;        // keeps probe lines whole
+} GbBatch;
+
+
+static double seconds(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/*---------------------------------------------------------------------------
+  These functions take a file off a worker's queue: pop for the owner,
+  steal for the others.
+
+   Returns: the file index, or -1 if the queue is empty
+---------------------------------------------------------------------------*/
+static int queuePop(GbDeque *q) {
+   int i = -1;
+
+   pthread_mutex_lock(&q->lock);
+   if (q->tail > q->head) {
+      i = q->items[--q->tail];
+   }
+   pthread_mutex_unlock(&q->lock);
+   return(i);
+}
+
+static int queueSteal(GbDeque *q) {
+   int i = -1;
+
+   pthread_mutex_lock(&q->lock);
+   if (q->tail > q->head) {
+      i = q->items[q->head++];
+   }
+   pthread_mutex_unlock(&q->lock);
+   return(i);
+}
+
+/*---------------------------------------------------------------------------
+  These functions find the next file for a worker: its own first, then
+  one stolen from the others, starting at a random one.
+
+   Returns: the file index, or -1 when no work is left anywhere
+---------------------------------------------------------------------------*/
+static int stealFile(GbWorker *w) {
+   GbBatch *b = w->batch;
+   int i, k, start;
+
+   start = rand_r(&w->seed) % b->nworkers;
+   for (k = 0; k < b->nworkers; k++) {
+      if ((i = queueSteal(&b->workers[(start + k) % b->nworkers].queue)) >= 0) {
+         w->steals++;
+         return(i);
+      }
+   }
+   return(-1);
+}
+
+static int nextFile(GbWorker *w) {
+   int i;
+
+   if ((i = queuePop(&w->queue)) >= 0) {
+      return(i);
+   }
+   return(stealFile(w));
+}
+
+/*---------------------------------------------------------------------------
+  This function makes the name of an output file: the input's base name
+  with a new extension, in the output directory.
+
+   Returns: 0 on success, -1 if that is the input file itself
+---------------------------------------------------------------------------*/
+static int outName(const GbBatch *b, const char *in, const char *ext, char *out, size_t len) {
+   const char *base = strrchr(in, '/');
+   const char *dot;
+   struct stat si, so;
+
+   base = base ? base + 1 : in;
+   dot = strrchr(base, '.');
+   snprintf(out, len, "%s/%.*s%s", b->outDir, dot ? (int)(dot - base) : (int)strlen(base),
+            base, ext);
+   if (stat(in, &si) == 0 && stat(out, &so) == 0 && si.st_dev == so.st_dev &&
+       si.st_ino == so.st_ino) {
+      return(-1);
+   }
+   return(0);
+}
+
+/* Frees a read-ahead slot and the file read into it. */
+static void readFree(GbIo *io) {
+   free(io->buf);
+   io->buf = NULL;
+   io->busy = 0;
+   io->stale = 0;
+}
+
+#ifdef GB_URING
+/*---------------------------------------------------------------------------
+  This function sets up a worker's io_uring with room for the reads ahead
+  and as many writes.  liburing is not needed: the rings are mapped as
+  the kernel describes them.
+
+   Returns: 0 on success, -1 if io_uring is not available
+---------------------------------------------------------------------------*/
+static int ringInit(GbRing *r, unsigned entries) {
+   struct io_uring_params p;
+   uint8_t *sq, *cq;
+
+   memset(&p, 0, sizeof(p));
+   r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+   if (r->fd < 0) {
+      return(-1);
+   }
+   r->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+   r->sqMap = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQ_RING);
+   r->cqMap = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_CQ_RING);
+   r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                  IORING_OFF_SQES);
+   if (r->sqMap == MAP_FAILED || r->cqMap == MAP_FAILED || r->sqes == MAP_FAILED ||
+       !(p.features & IORING_FEAT_RW_CUR_POS)) {
+      if (r->sqMap != MAP_FAILED) munmap(r->sqMap, r->sqLen);
+      if (r->cqMap != MAP_FAILED) munmap(r->cqMap, r->cqLen);
+      if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqesLen);
+      close(r->fd);
+      r->fd = -1;
+      return(-1);
+   }
+   sq = r->sqMap;
+   cq = r->cqMap;
+   r->sqHead = (unsigned *)(sq + p.sq_off.head);
+   r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+   r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+   r->sqArray = (unsigned *)(sq + p.sq_off.array);
+   r->entries = p.sq_entries;
+   r->cqHead = (unsigned *)(cq + p.cq_off.head);
+   r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+   r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+   r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   r->queued = 0;
+   return(0);
+}
+
+static void ringFree(GbRing *r) {
+   if (r->fd >= 0) {
+      munmap(r->sqMap, r->sqLen);
+      munmap(r->cqMap, r->cqLen);
+      munmap(r->sqes, r->sqesLen);
+      close(r->fd);
+      r->fd = -1;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function submits the queued requests and, when asked, waits for at
+  least one to complete.
+
+   Returns: nothing
+
+   Errors: exits if the kernel refuses the ring, as no request could then
+           complete
+---------------------------------------------------------------------------*/
+static void ringEnter(GbRing *r, unsigned wait) {
+   long ret;
+
+   do {
+      ret = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   } while (ret < 0 && errno == EINTR);
+   if (ret < 0) {
+      perror("io_uring_enter");
+      exit(GIF_ERROR);
+   }
+   r->queued -= (unsigned)ret;
+}
+
+/*---------------------------------------------------------------------------
+  This function queues one request for the next ringEnter().  Opens put the
+  flags in flags and the mode in len; reads and writes are at offset off.
+
+   Returns: nothing
+---------------------------------------------------------------------------*/
+static void ringPrep(GbRing *r, int op, int fd, const void *addr, unsigned len, size_t off,
+                     int flags, void *data) {
+   struct io_uring_sqe *sqe;
+   unsigned tail = *r->sqTail;
+
+   if (tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) == r->entries) {
+      ringEnter(r, 0);
+   }
+   sqe = &r->sqes[tail & *r->sqMask];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = op;
+   sqe->fd = fd;
+   sqe->addr = (uintptr_t)addr;
+   sqe->len = len;
+   sqe->off = off;
+   sqe->open_flags = flags;
+   sqe->user_data = (uintptr_t)data;
+   r->sqArray[tail & *r->sqMask] = tail & *r->sqMask;
+   __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+   r->queued++;
+}
+
+/* Queues the next read or write of a file, at most 1 GB at a time. */
+static void ioXfer(GbWorker *w, GbIo *io) {
+   ringPrep(&w->ring, io->write ? IORING_OP_WRITE : IORING_OP_READ, io->fd, &io->buf[io->done],
+            (unsigned)MIN(io->size - io->done, 1u << 30), io->done, 0, io);
+}
+
+/*---------------------------------------------------------------------------
+  This function moves a file on by one step when its request completes:
+  open, then read or write until it is all done, then close.  A finished
+  output is freed, and its file marked failed if anything went wrong; so
+  is a read of a file that was stolen meanwhile.
+
+   Returns: nothing
+---------------------------------------------------------------------------*/
+static void ioStep(GbWorker *w, GbIo *io, int res) {
+   switch (io->state) {
+   case IO_OPEN:
+      if (res < 0) {
+         io->err = 1;
+         io->state = IO_DONE;
+         break;
+      }
+      io->fd = res;
+      io->state = io->size ? IO_XFER : IO_CLOSE;
+      break;
+   case IO_XFER:
+      if (res < 0 || (res == 0 && io->write)) {
+         io->err = 1;
+         io->state = IO_CLOSE;
+      }
+      else if (res == 0) {
+         io->size = io->done;    // the file got shorter since it was listed
+         io->state = IO_CLOSE;
+      }
+      else if ((io->done += res) == io->size) {
+         io->state = IO_CLOSE;
+      }
+      break;
+   default:
+      if (res < 0 && io->write) {
+         io->err = 1;
+      }
+      io->state = IO_DONE;
+   }
+   if (io->state == IO_XFER) {
+      ioXfer(w, io);
+   }
+   else if (io->state == IO_CLOSE) {
+      ringPrep(&w->ring, IORING_OP_CLOSE, io->fd, NULL, 0, 0, 0, io);
+   }
+   else if (io->state == IO_DONE && io->stale) {
+      readFree(io);
+   }
+   else if (io->state == IO_DONE && io->write) {
+      if (io->err) {
+         w->batch->files[io->file].failed = 1;
+      }
+      free(io->name);
+      free(io->buf);
+      free(io);
+      w->writes--;
+   }
+}
+
+/* Queues the open of a file, the first step of reading or writing it. */
+static void ioOpen(GbWorker *w, GbIo *io, const char *name, int flags) {
+   ringPrep(&w->ring, IORING_OP_OPENAT, AT_FDCWD, name, 0644, 0, flags, io);
+}
+
+/* Moves on every file whose request has completed, without waiting. */
+static void ringReap(GbWorker *w) {
+   GbRing *r = &w->ring;
+   struct io_uring_cqe *cqe;
+   unsigned head = *r->cqHead;
+   GbIo *io;
+   int res;
+
+   while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = &r->cqes[head & *r->cqMask];
+      io = (GbIo *)(uintptr_t)cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(r->cqHead, ++head, __ATOMIC_RELEASE);
+      ioStep(w, io, res);
+   }
+}
+
+#else
+static int ringInit(GbRing *r, unsigned entries) {
+   r->fd = -1;
+   return(-1);
+}
+
+static void ringFree(GbRing *r) {
+}
+
+static void ringEnter(GbRing *r, unsigned wait) {
+}
+
+static void ioOpen(GbWorker *w, GbIo *io, const char *name, int flags) {
+}
+
+static void ringReap(GbWorker *w) {
+}
+#endif
+
+/* Starts reading a file into a free read-ahead slot. */
+static void readStart(GbWorker *w, GbIo *io, int pos, int file) {
+   GbFile *f = &w->batch->files[file];
+
+   memset(io, 0, sizeof(*io));
+   io->busy = 1;
+   io->pos = pos;
+   io->file = file;
+   io->size = f->bytes;
+   io->buf = malloc(MAX(io->size, 1));
+   if (!io->buf) {
+      io->err = 1;
+      io->state = IO_DONE;
+      return;
+   }
+   ioOpen(w, io, f->name, O_RDONLY);
+}
+
+/*---------------------------------------------------------------------------
+  This function finds a free read-ahead slot, waiting for the dropped
+  reads of stolen files to complete if need be.
+
+   Returns: the slot, or NULL if every slot holds a file still to be used
+---------------------------------------------------------------------------*/
+static GbIo *readSlot(GbWorker *w) {
+   int k, pending;
+
+   for (;;) {
+      pending = 0;
+      for (k = 0; k < w->batch->depth; k++) {
+         if (!w->reads[k].busy) {
+            return(&w->reads[k]);
+         }
+         pending |= w->reads[k].stale;
+      }
+      if (!pending) {
+         return(NULL);
+      }
+      ringEnter(&w->ring, 1);
+      ringReap(w);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function starts reading the next depth files of a worker's own
+  queue, those it will take from the tail.  They are left in the queue, so
+  thieves, who take from the head, can still have every one of them; a
+  read started for a file that was stolen is dropped.
+
+   Returns: nothing
+---------------------------------------------------------------------------*/
+static void readAhead(GbWorker *w) {
+   GbBatch *b = w->batch;
+   GbIo *io;
+   int k, pos, head, tail, found;
+
+   // Only the owner moves the tail, thieves only ever raise the head
+   pthread_mutex_lock(&w->queue.lock);
+   head = w->queue.head;
+   tail = w->queue.tail;
+   pthread_mutex_unlock(&w->queue.lock);
+
+   for (k = 0; k < b->depth; k++) {
+      io = &w->reads[k];
+      if (io->busy && io->pos >= 0 && io->pos < head) {
+         io->pos = -1;
+         io->stale = 1;
+         if (io->state == IO_DONE) {
+            readFree(io);
+         }
+      }
+   }
+   for (pos = tail - 1; pos >= MAX(head, tail - b->depth); pos--) {
+      for (k = found = 0; k < b->depth; k++) {
+         found |= w->reads[k].busy && w->reads[k].pos == pos;
+      }
+      if (!found) {
+         if (!(io = readSlot(w))) {
+            break;
+         }
+         readStart(w, io, pos, w->queue.items[pos]);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function finds a worker's next file and waits until it has been
+  read, while the files it will take after it are read ahead.  A stolen
+  file is read on its own.
+
+   Returns: the file index, or -1 when no work is left anywhere
+---------------------------------------------------------------------------*/
+static int nextRead(GbWorker *w) {
+   GbIo *io = NULL;
+   int i, k;
+
+   if (w->in) {
+      readFree(w->in);
+      w->in = NULL;
+   }
+   ringReap(w);
+   readAhead(w);
+   if ((i = queuePop(&w->queue)) >= 0) {
+      for (k = 0; k < w->batch->depth; k++) {
+         if (w->reads[k].busy && !w->reads[k].stale && w->reads[k].file == i) {
+            io = &w->reads[k];
+         }
+      }
+   }
+   else if ((i = stealFile(w)) < 0) {
+      // Let the dropped reads finish before their buffers go
+      for (k = 0; k < w->batch->depth; k++) {
+         while (w->reads[k].busy && w->reads[k].state != IO_DONE) {
+            ringEnter(&w->ring, 1);
+            ringReap(w);
+         }
+         if (w->reads[k].busy) {
+            readFree(&w->reads[k]);
+         }
+      }
+      return(-1);
+   }
+   if (!io && (io = readSlot(w)) != NULL) {
+      readStart(w, io, -1, i);
+   }
+   if (!io) {
+      return(i);                 // no slot: the job reads the file itself
+   }
+   io->pos = -1;
+   while (io->state != IO_DONE) {
+      ringEnter(&w->ring, 1);
+      ringReap(w);
+   }
+   // Whatever the completions queued runs while this file is worked on
+   if (w->ring.queued) {
+      ringEnter(&w->ring, 0);
+   }
+   w->in = io;
+   return(i);
+}
+
+/* Opens the input GIF: the copy read ahead, else the file itself. */
+static gd_GIF *openInput(GbWorker *w, GbFile *f) {
+   return(w->in ? gd_open_gif_mem(w->in->buf, w->in->size) : gd_open_gif(f->name));
+}
+
+/*---------------------------------------------------------------------------
+  This function writes an output file, taking over its buffer.  With a
+  ring the write is only queued, and goes out with the next reads; a
+  worker with depth writes pending waits for one to finish first.
+
+   Returns: 0 on success or if queued, -1 on error
+---------------------------------------------------------------------------*/
+static int putOutput(GbWorker *w, GbFile *f, const char *name, uint8_t *buf, size_t size) {
+   GbIo *io;
+   size_t done = 0;
+   long n = 0;
+   int fd;
+
+   if (!buf) {
+      return(-1);
+   }
+   if (w->ring.fd < 0) {
+      fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      while (fd >= 0 && done < size && (n = write(fd, &buf[done], size - done)) > 0) {
+         done += n;
+      }
+      free(buf);
+      if (fd < 0 || close(fd) != 0 || done < size) {
+         return(-1);
+      }
+      return(0);
+   }
+   while (w->writes >= w->batch->depth) {
+      ringEnter(&w->ring, 1);
+      ringReap(w);
+   }
+   io = calloc(1, sizeof(GbIo));
+   if (!io || !(io->name = strdup(name))) {
+      free(io);
+      free(buf);
+      return(-1);
+   }
+   io->write = 1;
+   io->file = f - w->batch->files;
+   io->buf = buf;
+   io->size = size;
+   w->writes++;
+   ioOpen(w, io, io->name, O_WRONLY | O_CREAT | O_TRUNC);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function decodes the first frame of a GIF into the worker's canvas,
+  growing it when the GIF is larger than any before.
+
+   Returns: the open GIF, or NULL on error
+---------------------------------------------------------------------------*/
+static gd_GIF *decodeFirst(GbWorker *w, GbFile *f) {
+   gd_GIF *gif = openInput(w, f);
+   size_t size;
+   pixel *rgb;
+
+   if (!gif) {
+      return(NULL);
+   }
+   size = (size_t)gif->width * gif->height;
+   if (size > w->rgbSize) {
+      rgb = realloc(w->rgb, size * sizeof(pixel));
+      if (!rgb) {
+         gd_close_gif(gif);
+         return(NULL);
+      }
+      w->rgb = rgb;
+      w->rgbSize = size;
+   }
+   if (gd_get_frame(gif) != 1) {
+      gd_close_gif(gif);
+      return(NULL);
+   }
+   gd_render_frame(gif, (uint8_t *)w->rgb);
+   return(gif);
+}
+
+/*---------------------------------------------------------------------------
+  Probe job: prints the size, frame count, running time and loop count of
+  a GIF.
+
+   Returns: 0 on success, -1 on error
+---------------------------------------------------------------------------*/
+static int probeFile(GbWorker *w, GbFile *f) {
+   gd_GIF *gif = openInput(w, f);
+   long time = 0;
+   int n = 0, ret;
+
+   if (!gif) {
+      return(-1);
+   }
+   while ((ret = gd_get_frame(gif)) == 1) {
+      n++;
+      time += gif->gce.delay;
+   }
+   pthread_mutex_lock(&w->batch->print);
+   printf("%s %dx%d %d images %.2f s loop %d\n", f->name, gif->width, gif->height, n,
+          time / 100.0, gif->has_loop ? gif->loop_count : -1);
+   pthread_mutex_unlock(&w->batch->print);
+   gd_close_gif(gif);
+   return(ret);
+}
+
+/*---------------------------------------------------------------------------
+  PPM job: writes the first frame of a GIF as a PPM file.
+
+   Returns: 0 on success, -1 on error
+---------------------------------------------------------------------------*/
+static int ppmFile(GbWorker *w, GbFile *f) {
+   char name[PATH_MAX], head[32];
+   gd_GIF *gif = decodeFirst(w, f);
+   size_t size;
+   uint8_t *buf;
+   int n;
+
+   if (!gif) {
+      return(-1);
+   }
+   n = snprintf(head, sizeof(head), "P6\n%d %d\n255\n", gif->width, gif->height);
+   size = 3 * (size_t)gif->width * gif->height;
+   buf = malloc(n + size);
+   if (buf) {
+      memcpy(buf, head, n);
+      memcpy(&buf[n], w->rgb, size);
+   }
+   gd_close_gif(gif);
+   if (outName(w->batch, f->name, ".ppm", name, sizeof(name)) < 0) {
+      free(buf);
+      return(-1);
+   }
+   return(putOutput(w, f, name, buf, n + size));
+}
+
+/*---------------------------------------------------------------------------
+  Transcode job: copies every frame into a new GIF, on this worker's
+  thread and with its inverse colormap and frame buffers.
+
+   Returns: 0 on success, -1 on error
+---------------------------------------------------------------------------*/
+static int transcodeFile(GbWorker *w, GbFile *f) {
+   char name[PATH_MAX];
+   int ret;
+
+   if (outName(w->batch, f->name, ".gif", name, sizeof(name)) < 0) {
+      return(-1);
+   }
+   if (!w->in) {
+      w->tc.data = NULL;
+      w->tc.size = 0;
+      return(ge_transcode(f->name, name, &w->tc) < 0 ? -1 : 0);
+   }
+   // Read and written through the ring: both ends stay in memory
+   w->tc.data = w->in->buf;
+   w->tc.size = w->in->size;
+   ret = ge_transcode(f->name, NULL, &w->tc);
+   w->tc.data = NULL;
+   w->tc.size = 0;
+   if (ret < 0) {
+      free(w->tc.out);
+      return(-1);
+   }
+   return(putOutput(w, f, name, w->tc.out, w->tc.outSize));
+}
+
+/*---------------------------------------------------------------------------
+  Thumbnail job: shrinks the first frame to fit a square of thumbSize
+  pixels, averaging the pixels each one covers, and writes it as a GIF
+  with a palette of its own.
+
+   Returns: 0 on success, -1 on error
+---------------------------------------------------------------------------*/
+static int thumbFile(GbWorker *w, GbFile *f) {
+   char name[PATH_MAX];
+   pixel palette[MAX_PALETTE];
+   ge_QuantOpts opt;
+   ge_Options enc;
+   uint8_t *buf;
+   size_t size;
+   gd_GIF *gif = decodeFirst(w, f);
+   ge_GIF *out;
+   int W, H, tw, th, x, y, i, j, x0, x1, y0, y1, n, last;
+   long r, g, b;
+
+   if (!gif) {
+      return(-1);
+   }
+   W = gif->width;
+   H = gif->height;
+   tw = W;
+   th = H;
+   if (MAX(W, H) > w->batch->thumbSize) {
+      tw = MAX(1, (int)((long)W * w->batch->thumbSize / MAX(W, H)));
+      th = MAX(1, (int)((long)H * w->batch->thumbSize / MAX(W, H)));
+   }
+   for (y = 0; y < th; y++) {
+      y0 = (long)y * H / th;
+      y1 = MAX(y0 + 1, (int)((long)(y + 1) * H / th));
+      for (x = 0; x < tw; x++) {
+         x0 = (long)x * W / tw;
+         x1 = MAX(x0 + 1, (int)((long)(x + 1) * W / tw));
+         r = g = b = 0;
+         for (i = y0; i < y1; i++) {
+            for (j = x0; j < x1; j++) {
+               r += w->rgb[i * W + j].r;
+               g += w->rgb[i * W + j].g;
+               b += w->rgb[i * W + j].b;
+            }
+         }
+         n = (y1 - y0) * (x1 - x0);
+         w->thumb[y * tw + x] = (pixel) {(r + n / 2) / n, (g + n / 2) / n, (b + n / 2) / n};
+      }
+   }
+   gd_close_gif(gif);
+
+   memset(&opt, 0, sizeof(opt));
+   opt.invmap = w->invmap;
+   last = createGIFex(w->thumb, w->index, tw, th, palette, MAX_PALETTE, &opt);
+   if (last < 0) {
+      return(-1);
+   }
+   if (outName(w->batch, f->name, ".gif", name, sizeof(name)) < 0) {
+      return(-1);
+   }
+   memset(&enc, 0, sizeof(enc));
+   enc.memory = 1;
+   out = ge_new_gif_opt(name, tw, th, (uint8_t *)palette, last + 1, -1, &enc);
+   if (!out) {
+      return(-1);
+   }
+   ge_add_frame_buf(out, w->index, 0);
+   buf = ge_close_gif_mem(out, &size);
+   return(putOutput(w, f, name, buf, size));
+}
+
+/* Worker thread: runs jobs until no file is left. */
+static void *worker(void *arg) {
+   GbWorker *w = arg;
+   GbBatch *b = w->batch;
+   GbFile *f;
+   double start;
+   int i, ret;
+
+   while ((i = b->depth ? nextRead(w) : nextFile(w)) >= 0) {
+      f = &b->files[i];
+      if (w->in && w->in->err) {
+         f->failed = 1;
+         continue;
+      }
+      start = seconds();
+      switch (b->job) {
+      case JOB_PROBE:
+         ret = probeFile(w, f);
+         break;
+      case JOB_PPM:
+         ret = ppmFile(w, f);
+         break;
+      case JOB_TRANSCODE:
+         ret = transcodeFile(w, f);
+         break;
+      default:
+         ret = thumbFile(w, f);
+      }
+      f->seconds = seconds() - start;
+      f->failed |= ret < 0;
+   }
+   while (w->writes) {
+      ringEnter(&w->ring, 1);
+      ringReap(w);
+   }
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+  This function adds a file to the batch.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int addFile(GbBatch *b, int *cap, const char *name) {
+   GbFile *files;
+   struct stat sb;
+
+   if (b->nfiles == *cap) {
+      *cap = *cap ? 2 * *cap : 256;
+      files = realloc(b->files, *cap * sizeof(GbFile));
+      if (!files) {
+         return(-1);
+      }
+      b->files = files;
+   }
+   memset(&b->files[b->nfiles], 0, sizeof(GbFile));
+   b->files[b->nfiles].name = strdup(name);
+   if (!b->files[b->nfiles].name) {
+      return(-1);
+   }
+   b->files[b->nfiles].bytes = stat(name, &sb) == 0 ? (long)sb.st_size : 0;
+   b->nfiles++;
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function lists the input: the .gif files of a directory, or the
+  paths in a list file, one per line ("-" reads the list from stdin).
+
+   Returns: 0 on success, -1 if the input cannot be read, -2 if out of memory
+---------------------------------------------------------------------------*/
+static int listFiles(GbBatch *b, const char *input) {
+   char line[GB_LINE], path[PATH_MAX];
+   struct dirent *de;
+   struct stat sb;
+   DIR *dir;
+   FILE *fp;
+   size_t len;
+   int cap = 0, ret = 0;
+
+   if (stat(input, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+      if (!(dir = opendir(input))) {
+         return(-1);
+      }
+      while ((de = readdir(dir)) != NULL) {
+         len = strlen(de->d_name);
+         if (len > 4 && !strcasecmp(&de->d_name[len - 4], ".gif")) {
+            snprintf(path, sizeof(path), "%s/%s", input, de->d_name);
+            if (addFile(b, &cap, path) < 0) {
+               closedir(dir);
+               return(-2);
+            }
+         }
+      }
+      closedir(dir);
+      return(0);
+   }
+   fp = strcmp(input, "-") ? fopen(input, "r") : stdin;
+   if (!fp) {
+      return(-1);
+   }
+   while (fgets(line, sizeof(line), fp)) {
+      line [strcspn(line, "\r\n")] = 0;
+      if (line [0] && addFile(b, &cap, line) < 0) {
+         ret = -2;
+         break;
+      }
+   }
+   if (fp != stdin) {
+      fclose(fp);
+   }
+   return(ret);
+}
+
+static int cmpDouble(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+
+   return((x > y) - (x < y));
+}
+
+
+/*---------------------------------------------------------------------------
+  Runs one job over a batch of GIF files and reports the throughput
+---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+   GbBatch b;
+   GbWorker *w;
+   double start, elapsed, *lat;
+   long bytes = 0;
+   int i, k, n, arg, failed = 0, steals = 0, threads = 0;
+
+   memset(&b, 0, sizeof(b));
+   b.outDir = NULL;
+   b.thumbSize = GB_THUMB;
+   b.depth = GB_DEPTH;
+   for (arg = 1; arg < argc - 2 && argv [arg][0] == '-'; arg += 2) {
+      if (!strcmp(argv [arg], "-j")) {
+         threads = atoi(argv [arg + 1]);
+      }
+      else if (!strcmp(argv [arg], "-o")) {
+         b.outDir = argv [arg + 1];
+      }
+      else if (!strcmp(argv [arg], "-s")) {
+         b.thumbSize = MAX(1, atoi(argv [arg + 1]));
+      }
+      else if (!strcmp(argv [arg], "-q")) {
+         b.depth = MAX(0, atoi(argv [arg + 1]));
+      }
+      else {
+         break;
+      }
+   }
+   b.job = -1;
+   if (argc - arg == 2) {
+      for (i = 0; i < 4; i++) {
+         if (!strcmp(argv [arg], jobNames [i])) {
+            b.job = i;
+         }
+      }
+   }
+   if (b.job < 0 || (b.job != JOB_PROBE && !b.outDir)) {
+      fprintf(stderr, "This program runs one job over many GIF files\n");
+      fprintf(stderr, "%s [-j threads] [-o outDir] [-s size] [-q depth] job dir|list\n", argv[0]);
+      fprintf(stderr, "Where: job       - probe, ppm, transcode or thumb\n");
+      fprintf(stderr, "       dir|list  - a directory of .gif files or a file listing them, - for stdin\n");
+      fprintf(stderr, "       -j        - worker threads, default one per CPU\n");
+      fprintf(stderr, "       -o        - where ppm, transcode and thumb write, required for them\n");
+      fprintf(stderr, "       -s        - thumbnail size, default %d\n", GB_THUMB);
+      fprintf(stderr, "       -q        - files each worker reads ahead through io_uring, default %d,\n", GB_DEPTH);
+      fprintf(stderr, "                   0 for blocking I/O\n");
+      return(SYNTAX_ERROR);
+   }
+
+   i = listFiles(&b, argv [arg + 1]);
+   if (i == -1) {
+      fprintf(stderr, "Could not read %s\n", argv [arg + 1]);
+      return(FILE_NOT_FOUND);
+   }
+   if (threads <= 0) {
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   b.nworkers = MAX(1, MIN(threads, MAX(b.nfiles, 1)));
+   b.workers = calloc(b.nworkers, sizeof(GbWorker));
+   lat = malloc(MAX(b.nfiles, 1) * sizeof(double));
+   if (i < 0 || !b.workers || !lat) {
+      fprintf(stderr, "Out of memory\n");
+      return(MALLOC_ERROR);
+   }
+   pthread_mutex_init(&b.print, NULL);
+
+   // Deal the files out in runs, one per worker
+   for (k = 0; k < b.nworkers; k++) {
+      w = &b.workers[k];
+      w->batch = &b;
+      w->seed = k + 1;
+      pthread_mutex_init(&w->queue.lock, NULL);
+      w->queue.head = (long)b.nfiles * k / b.nworkers;
+      w->queue.tail = (long)b.nfiles * (k + 1) / b.nworkers;
+      w->queue.items = malloc(MAX(b.nfiles, 1) * sizeof(int));
+      w->thumb = malloc((size_t)b.thumbSize * b.thumbSize * sizeof(pixel));
+      w->index = malloc((size_t)b.thumbSize * b.thumbSize);
+      w->invmap = ge_invmap_new();
+      if (!w->queue.items || !w->thumb || !w->index || !w->invmap) {
+         fprintf(stderr, "Out of memory\n");
+         return(MALLOC_ERROR);
+      }
+      for (i = w->queue.head; i < w->queue.tail; i++) {
+         w->queue.items[i] = i;
+      }
+      w->tc.serial = 1;
+      w->tc.keep_frames = 1;
+      w->tc.quant.invmap = w->invmap;
+      w->ring.fd = -1;
+   }
+
+   // One ring per worker, or blocking I/O for all if any cannot have one
+   for (k = 0; k < b.nworkers && b.depth > 0; k++) {
+      w = &b.workers[k];
+      w->reads = calloc(b.depth, sizeof(GbIo));
+      if (!w->reads || ringInit(&w->ring, 2 * b.depth) < 0) {
+         for (i = 0; i <= k; i++) {
+            ringFree(&b.workers[i].ring);
+         }
+         b.depth = 0;
+      }
+   }
+
+   start = seconds();
+   for (k = 0; k < b.nworkers; k++) {
+      // Whoever did start steals the files of a worker that did not
+      b.workers[k].started = pthread_create(&b.workers[k].thread, NULL, worker,
+                                            &b.workers[k]) == 0;
+   }
+   if (!b.workers[0].started) {
+      worker(&b.workers[0]);
+   }
+   for (k = 0; k < b.nworkers; k++) {
+      if (b.workers[k].started) {
+         pthread_join(b.workers[k].thread, NULL);
+      }
+   }
+   elapsed = seconds() - start;
+
+   // Failed files may not have been timed, so only the others make the latency
+   for (i = n = 0; i < b.nfiles; i++) {
+      if (b.files[i].failed) {
+         fprintf(stderr, "Failed: %s\n", b.files[i].name);
+         failed++;
+      }
+      else {
+         lat[n++] = b.files[i].seconds;
+      }
+      bytes += b.files[i].bytes;
+   }
+   qsort(lat, n, sizeof(double), cmpDouble);
+   for (k = 0; k < b.nworkers; k++) {
+      steals += b.workers[k].steals;
+   }
+   printf("%s: %d files, %d failed, %d threads, %d steals, %.3f s, ", jobNames [b.job],
+          b.nfiles, failed, b.nworkers, steals, elapsed);
+   if (b.depth) {
+      printf("io_uring %d ahead\n", b.depth);
+   }
+   else {
+      printf("blocking I/O\n");
+   }
+   printf("%.1f files/s, %.2f MB/s\n", b.nfiles / MAX(elapsed, 1e-9),
+          bytes / MAX(elapsed, 1e-9) / 1e6);
+   if (n) {
+      printf("Latency per file: p50 %.2f ms, p99 %.2f ms, max %.2f ms over %d files\n",
+             1e3 * lat[(n - 1) / 2], 1e3 * lat[(int)((n - 1) * 0.99)], 1e3 * lat[n - 1], n);
+   }
+
+   for (k = 0; k < b.nworkers; k++) {
+      w = &b.workers[k];
+      pthread_mutex_destroy(&w->queue.lock);
+      free(w->queue.items);
+      free(w->rgb);
+      free(w->thumb);
+      free(w->index);
+      ge_invmap_free(w->invmap);
+      free(w->tc.frames);
+      ringFree(&w->ring);
+      free(w->reads);
+   }
+   for (i = 0; i < b.nfiles; i++) {
+      free(b.files[i].name);
+   }
+   free(b.files);
+   free(b.workers);
+   free(lat);
+   pthread_mutex_destroy(&b.print);
+   return(failed ? GIF_ERROR : SUCCESS);
+}
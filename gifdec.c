@@ -28,45 +28,66 @@ typedef struct Table {
     Entry *entries;
 } Table;
 
-static uint16_t read_num(int fd) {
+/* All input goes through these: the file, or with gif->data a buffer in
+ * memory, read the same way. */
+static long gd_read(gd_GIF *gif, void *buf, size_t n) {
+    if (!gif->data)
+        return read(gif->fd, buf, n);
+    if (gif->pos >= (off_t) gif->size)
+        return 0;
+    n = MIN(n, gif->size - gif->pos);
+    memcpy(buf, &gif->data[gif->pos], n);
+    gif->pos += n;
+    return n;
+}
+
+static off_t gd_lseek(gd_GIF *gif, off_t offset, int whence) {
+    if (!gif->data)
+        return lseek(gif->fd, offset, whence);
+    if (whence == SEEK_CUR)
+        offset += gif->pos;
+    else if (whence == SEEK_END)
+        offset += gif->size;
+    if (offset < 0)
+        return -1;
+    gif->pos = offset;
+    return offset;
+}
+
+static uint16_t read_num(gd_GIF *gif) {
     uint8_t bytes[2];
 
-    read(fd, bytes, 2);
+    gd_read(gif, bytes, 2);
     return bytes[0] + (((uint16_t) bytes[1]) << 8);
 }
 
-gd_GIF *gd_open_gif(const char *fname) {
-    int fd;
+/* Read the header of the GIF src reads from and set up the decoder. */
+static gd_GIF *open_gif(gd_GIF *src) {
     uint8_t sigver[3];
     uint16_t width, height, depth;
     uint8_t fdsz, bgidx, aspect;
     int i;
     uint8_t *bgcolor;
     int gct_sz;
-    gd_GIF *gif;
+    gd_GIF *gif = NULL;
 
-    fd = open(fname, O_RDONLY);
-    if (fd == -1) return NULL;
-#ifdef _WIN32
-    setmode(fd, O_BINARY);
-#endif
     /* Header */
-    read(fd, sigver, 3);
+    gd_read(src, sigver, 3);
     if (memcmp(sigver, "GIF", 3) != 0) {
         fprintf(stderr, "invalid signature\n");
         goto fail;
     }
     /* Version */
-    read(fd, sigver, 3);
+    gd_read(src, sigver, 3);
     if (memcmp(sigver, "89a", 3) != 0) {
         fprintf(stderr, "invalid version\n");
         goto fail;
     }
     /* Width x Height */
-    width  = read_num(fd);
-    height = read_num(fd);
+    width  = read_num(src);
+    height = read_num(src);
     /* FDSZ */
-    read(fd, &fdsz, 1);
+    gd_read(src, &fdsz, 1);
     /* Presence of GCT */
     if (!(fdsz & 0x80)) {
         fprintf(stderr, "no global color table\n");
@@ -78,19 +99,22 @@ gd_GIF *gd_open_gif(const char *fname) {
     /* GCT Size */
     gct_sz = 1 << ((fdsz & 0x07) + 1);
     /* Background Color Index */
-    read(fd, &bgidx, 1);
+    gd_read(src, &bgidx, 1);
     /* Aspect Ratio */
-    read(fd, &aspect, 1);
+    gd_read(src, &aspect, 1);
     /* Create gd_GIF Structure. */
     gif = calloc(1, sizeof(*gif) + 4 * width * height);
     if (!gif) goto fail;
-    gif->fd = fd;
+    gif->fd = src->fd;
+    gif->data = src->data;
+    gif->size = src->size;
+    gif->pos = src->pos;
     gif->width  = width;
     gif->height = height;
     gif->depth  = depth;
     /* Read GCT */
     gif->gct.size = gct_sz;
-    read(fd, gif->gct.colors, 3 * gif->gct.size);
+    gd_read(gif, gif->gct.colors, 3 * gif->gct.size);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
     gif->canvas = (uint8_t *) &gif[1];
@@ -101,20 +125,43 @@ gd_GIF *gd_open_gif(const char *fname) {
     if (bgcolor[0] || bgcolor[1] || bgcolor [2])
         for (i = 0; i < gif->width * gif->height; i++)
             memcpy(&gif->canvas[i*3], bgcolor, 3);
-    gif->anim_start = lseek(fd, 0, SEEK_CUR);
-    goto ok;
+    gif->anim_start = gd_lseek(gif, 0, SEEK_CUR);
 fail:
-    close(fd);
-ok:
     return gif;
 }
 
+gd_GIF *gd_open_gif(const char *fname) {
+    gd_GIF src = {0}, *gif;
+
+    src.fd = open(fname, O_RDONLY);
+    if (src.fd == -1) return NULL;
+#ifdef _WIN32
+    setmode(src.fd, O_BINARY);
+#endif
+    gif = open_gif(&src);
+    if (!gif)
+        close(src.fd);
+    return gif;
+}
+
+/* Decode a GIF held in memory.  data is not copied and must stay valid
+ * until gd_close_gif(). */
+gd_GIF *gd_open_gif_mem(const uint8_t *data, size_t size) {
+    gd_GIF src = {0};
+
+    src.fd = -1;
+    src.data = data;
+    src.size = size;
+    return open_gif(&src);
+}
+
 static void discard_sub_blocks(gd_GIF *gif) {
     uint8_t size;
 
     do {
-        read(gif->fd, &size, 1);
-        lseek(gif->fd, size, SEEK_CUR);
+        if (gd_read(gif, &size, 1) != 1)
+            break; /* truncated file */
+        gd_lseek(gif, size, SEEK_CUR);
     } while (size);
 }
 
@@ -123,21 +170,21 @@ static void read_plain_text_ext(gd_GIF *gif) {
         uint16_t tx, ty, tw, th;
         uint8_t cw, ch, fg, bg;
         off_t sub_block;
-        lseek(gif->fd, 1, SEEK_CUR); /* block size = 12 */
-        tx = read_num(gif->fd);
-        ty = read_num(gif->fd);
-        tw = read_num(gif->fd);
-        th = read_num(gif->fd);
-        read(gif->fd, &cw, 1);
-        read(gif->fd, &ch, 1);
-        read(gif->fd, &fg, 1);
-        read(gif->fd, &bg, 1);
-        sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        gd_lseek(gif, 1, SEEK_CUR); /* block size = 12 */
+        tx = read_num(gif);
+        ty = read_num(gif);
+        tw = read_num(gif);
+        th = read_num(gif);
+        gd_read(gif, &cw, 1);
+        gd_read(gif, &ch, 1);
+        gd_read(gif, &fg, 1);
+        gd_read(gif, &bg, 1);
+        sub_block = gd_lseek(gif, 0, SEEK_CUR);
         gif->plain_text(gif, tx, ty, tw, th, cw, ch, fg, bg);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_lseek(gif, sub_block, SEEK_SET);
     } else {
         /* Discard plain text metadata. */
-        lseek(gif->fd, 13, SEEK_CUR);
+        gd_lseek(gif, 13, SEEK_CUR);
     }
     /* Discard plain text sub-blocks. */
     discard_sub_blocks(gif);
@@ -147,47 +194,75 @@ static void read_graphic_control_ext(gd_GIF *gif) {
     uint8_t rdit;
 
     /* Discard block size (always 0x04). */
-    lseek(gif->fd, 1, SEEK_CUR);
-    read(gif->fd, &rdit, 1);
+    gd_lseek(gif, 1, SEEK_CUR);
+    gd_read(gif, &rdit, 1);
     gif->gce.disposal = (rdit >> 2) & 3;
     gif->gce.input = rdit & 2;
     gif->gce.transparency = rdit & 1;
-    gif->gce.delay = read_num(gif->fd);
-    read(gif->fd, &gif->gce.tindex, 1);
+    gif->gce.delay = read_num(gif);
+    gd_read(gif, &gif->gce.tindex, 1);
     /* Skip block terminator. */
-    lseek(gif->fd, 1, SEEK_CUR);
+    gd_lseek(gif, 1, SEEK_CUR);
 }
 
 static void read_comment_ext(gd_GIF *gif) {
     if (gif->comment) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = gd_lseek(gif, 0, SEEK_CUR);
         gif->comment(gif);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_lseek(gif, sub_block, SEEK_SET);
     }
     /* Discard comment sub-blocks. */
     discard_sub_blocks(gif);
 }
 
+/* Read the entries of a seek index extension, see GE_SEEK_APP. */
+static void read_seek_index(gd_GIF *gif) {
+    uint8_t size, block[0xFF];
+    uint32_t *seek;
+    int i, n;
+
+    gif->nseek = 0;
+    while (gd_read(gif, &size, 1) == 1 && size) {
+        if (gd_read(gif, block, size) != size)
+            break;
+        /* The 4 byte block pointing back at the extension is not an entry. */
+        n = size / GE_SEEK_ENTRY;
+        if (size == 4 || !n)
+            continue;
+        seek = realloc(gif->seek, 3 * sizeof(*seek) * (gif->nseek + n));
+        if (!seek)
+            break;
+        gif->seek = seek;
+        for (i = 0; i < 3 * n; i++)
+            seek[3 * gif->nseek + i] = block[4*i] | block[4*i+1] << 8 |
+                                       block[4*i+2] << 16 | (uint32_t) block[4*i+3] << 24;
+        gif->nseek += n;
+    }
+}
+
 static void read_application_ext(gd_GIF *gif) {
     char app_id[8];
     char app_auth_code[3];
 
     /* Discard block size (always 0x0B). */
-    lseek(gif->fd, 1, SEEK_CUR);
+    gd_lseek(gif, 1, SEEK_CUR);
     /* Application Identifier. */
-    read(gif->fd, app_id, 8);
+    gd_read(gif, app_id, 8);
     /* Application Authentication Code. */
-    read(gif->fd, app_auth_code, 3);
+    gd_read(gif, app_auth_code, 3);
     if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
         /* Discard block size (0x03) and constant byte (0x01). */
-        lseek(gif->fd, 2, SEEK_CUR);
-        gif->loop_count = read_num(gif->fd);
+        gd_lseek(gif, 2, SEEK_CUR);
+        gif->loop_count = read_num(gif);
+        gif->has_loop = 1;
         /* Skip block terminator. */
-        lseek(gif->fd, 1, SEEK_CUR);
+        gd_lseek(gif, 1, SEEK_CUR);
+    } else if (!memcmp(app_id, GE_SEEK_APP, 8) && !memcmp(app_auth_code, &GE_SEEK_APP[8], 3)) {
+        read_seek_index(gif);
     } else if (gif->application) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = gd_lseek(gif, 0, SEEK_CUR);
         gif->application(gif, app_id, app_auth_code);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_lseek(gif, sub_block, SEEK_SET);
         discard_sub_blocks(gif);
     } else {
         discard_sub_blocks(gif);
@@ -197,7 +272,7 @@ static void read_application_ext(gd_GIF *gif) {
 static void read_ext(gd_GIF *gif) {
     uint8_t label;
 
-    read(gif->fd, &label, 1);
+    gd_read(gif, &label, 1);
     switch (label) {
     case 0x01:
         read_plain_text_ext(gif);
@@ -262,11 +337,11 @@ static uint16_t get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *sh
         if (rpad == 0) {
             /* Update byte. */
             if (*sub_len == 0) {
-                read(gif->fd, sub_len, 1); /* Must be nonzero! */
+                gd_read(gif, sub_len, 1); /* Must be nonzero! */
                 if (*sub_len == 0)
                     return 0x1000;
             }
-            read(gif->fd, byte, 1);
+            gd_read(gif, byte, 1);
             (*sub_len)--;
         }
         frag_size = MIN(key_size - bits_read, 8 - rpad);
@@ -302,7 +377,7 @@ static int interlaced_line_index(int h, int y) {
  * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table). */
 static int read_image_data(gd_GIF *gif, int interlace) {
     uint8_t sub_len, shift, byte;
-    int init_key_size, key_size, table_is_full;
+    int init_key_size, key_size, table_is_full, added;
     int frm_off, frm_size, str_len, i, p, x, y;
     uint16_t key, clear, stop;
     int ret;
@@ -310,12 +385,12 @@ static int read_image_data(gd_GIF *gif, int interlace) {
     Entry entry;
     off_t start, end;
 
-    read(gif->fd, &byte, 1);
+    gd_read(gif, &byte, 1);
     key_size = (int) byte;
-    start = lseek(gif->fd, 0, SEEK_CUR);
+    start = gd_lseek(gif, 0, SEEK_CUR);
     discard_sub_blocks(gif);
-    end = lseek(gif->fd, 0, SEEK_CUR);
-    lseek(gif->fd, start, SEEK_SET);
+    end = gd_lseek(gif, 0, SEEK_CUR);
+    gd_lseek(gif, start, SEEK_SET);
     clear = 1 << key_size;
     stop = clear + 1;
     table = new_table(key_size);
@@ -327,12 +402,14 @@ static int read_image_data(gd_GIF *gif, int interlace) {
     ret = 0;
     frm_size = gif->fw*gif->fh;
     while (frm_off < frm_size) {
+        added = 0;
         if (key == clear) {
             key_size = init_key_size;
             table->nentries = (1 << (key_size - 1)) + 2;
             table_is_full = 0;
         } else if (!table_is_full) {
             ret = add_entry(&table, str_len + 1, key, entry.suffix);
+            added = 1;
             if (ret == -1) {
                 free(table);
                 return -1;
@@ -344,7 +421,9 @@ static int read_image_data(gd_GIF *gif, int interlace) {
         }
         key = get_key(gif, key_size, &sub_len, &shift, &byte);
         if (key == clear) continue;
-        if (key == stop || key == 0x1000) break;
+        /* A code past the table only comes from corrupt or truncated data:
+         * stop there, as at the end of the data. */
+        if (key == stop || key == 0x1000 || key >= table->nentries) break;
         if (ret == 1) key_size++;
         entry = table->entries[key];
         str_len = entry.length;
@@ -361,13 +440,16 @@ static int read_image_data(gd_GIF *gif, int interlace) {
                 entry = table->entries[entry.prefix];
         }
         frm_off += str_len;
-        if (key < table->nentries - 1 && !table_is_full)
+        /* Fix the suffix of the entry added above, including the last one
+         * that fills the table: encoders that defer the clear code may use
+         * it afterwards. */
+        if (key < table->nentries - 1 && added)
             table->entries[table->nentries - 1].suffix = entry.suffix;
     }
     free(table);
     if (key == stop)
-        read(gif->fd, &sub_len, 1); /* Must be zero! */
-    lseek(gif->fd, end, SEEK_SET);
+        gd_read(gif, &sub_len, 1); /* Must be zero! */
+    gd_lseek(gif, end, SEEK_SET);
     return 0;
 }
 
@@ -378,18 +460,18 @@ static int read_image(gd_GIF *gif) {
     int interlace;
 
     /* Image Descriptor. */
-    gif->fx = read_num(gif->fd);
-    gif->fy = read_num(gif->fd);
-    gif->fw = read_num(gif->fd);
-    gif->fh = read_num(gif->fd);
-    read(gif->fd, &fisrz, 1);
+    gif->fx = read_num(gif);
+    gif->fy = read_num(gif);
+    gif->fw = read_num(gif);
+    gif->fh = read_num(gif);
+    gd_read(gif, &fisrz, 1);
     interlace = fisrz & 0x40;
     /* Ignore Sort Flag. */
     /* Local Color Table? */
     if (fisrz & 0x80) {
         /* Read LCT */
         gif->lct.size = 1 << ((fisrz & 0x07) + 1);
-        read(gif->fd, gif->lct.colors, 3 * gif->lct.size);
+        gd_read(gif, gif->lct.colors, 3 * gif->lct.size);
         gif->palette = &gif->lct;
     } else
         gif->palette = &gif->gct;
@@ -439,14 +521,18 @@ int gd_get_frame(gd_GIF *gif) {
     char sep;
 
     dispose(gif);
-    read(gif->fd, &sep, 1);
+    /* A graphic control extension only applies to the image after it. */
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    if (gd_read(gif, &sep, 1) != 1)
+        return -1;
     while (sep != ',') {
         if (sep == ';')
             return 0;
         if (sep == '!')
             read_ext(gif);
         else return -1;
-        read(gif->fd, &sep, 1);
+        if (gd_read(gif, &sep, 1) != 1)
+            return -1;
     }
     if (read_image(gif) == -1)
         return -1;
@@ -458,15 +544,93 @@ void gd_render_frame(gd_GIF *gif, uint8_t *buffer) {
     render_frame_rect(gif, buffer);
 }
 
+/* Planar version of gd_render_frame(): img must be at least the size of the
+ * GIF.  The canvas is split into planes and the frame drawn on top of them
+ * through a palette of packed colors, a vector of pixels at a time. */
+void gd_render_frame_planar(gd_GIF *gif, ge_Planar *img) {
+    uint32_t pal[0x100];
+    uint8_t *c;
+    int i, y, tindex = gif->gce.transparency ? gif->gce.tindex : -1;
+    size_t off;
+
+    for (y = 0; y < gif->height; y++) {
+        off = (size_t) y * img->stride;
+        ge_planar_unpack((const pixel *) &gif->canvas[y * gif->width * 3], gif->width,
+                         &img->plane[0][off], &img->plane[1][off], &img->plane[2][off]);
+    }
+    memset(pal, 0, sizeof(pal));
+    for (i = 0; i < gif->palette->size; i++) {
+        c = &gif->palette->colors[i * 3];
+        pal[i] = c[0] | (c[1] << 8) | ((uint32_t) c[2] << 16);
+    }
+    for (y = gif->fy; y < gif->fy + gif->fh; y++) {
+        off = (size_t) y * img->stride + gif->fx;
+        ge_planar_lookup(&gif->frame[y * gif->width + gif->fx], gif->fw, pal, tindex,
+                         &img->plane[0][off], &img->plane[1][off], &img->plane[2][off]);
+    }
+}
+
 int gd_is_bgcolor(gd_GIF *gif, uint8_t color[3]) {
     return !memcmp(&gif->palette->colors[gif->bgindex*3], color, 3);
 }
 
 void gd_rewind(gd_GIF *gif) {
-    lseek(gif->fd, gif->anim_start, SEEK_SET);
+    gd_lseek(gif, gif->anim_start, SEEK_SET);
+}
+
+/* Find the seek index from the end of the file: its last sub-block holds
+ * the offset of the extension, followed by the terminator and the trailer.
+ * Return 0 if an index was read, -1 otherwise. */
+static int load_seek_index(gd_GIF *gif) {
+    uint8_t tail[7], head[3];
+    off_t pos = gd_lseek(gif, 0, SEEK_CUR), start;
+
+    if (gd_lseek(gif, -7, SEEK_END) >= 0 && gd_read(gif, tail, 7) == 7 &&
+        tail[0] == 4 && tail[5] == 0 && tail[6] == ';') {
+        start = tail[1] | tail[2] << 8 | tail[3] << 16 | (uint32_t) tail[4] << 24;
+        if (gd_lseek(gif, start, SEEK_SET) == start && gd_read(gif, head, 2) == 2 &&
+            head[0] == '!' && head[1] == 0xFF)
+            read_application_ext(gif);
+    }
+    gd_lseek(gif, pos, SEEK_SET);
+    return gif->nseek ? 0 : -1;
+}
+
+/* Seek to the last keyframe at or before image number `image` (counting
+ * gd_get_frame() calls from 0), so the next gd_get_frame() returns it and the
+ * canvas is right from there on.  The seek index is read the first time.
+ * Return the image number of that keyframe, or -1 if the file has no index. */
+int gd_seek(gd_GIF *gif, int image) {
+    int lo, hi, mid, i;
+    uint8_t *bgcolor;
+
+    if (!gif->nseek && load_seek_index(gif) < 0)
+        return -1;
+    /* Entries are in file order; find the last one not after image. */
+    lo = 0;
+    hi = gif->nseek - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (gif->seek[3 * mid] <= (uint32_t) MAX(image, 0))
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    gd_lseek(gif, gif->seek[3 * lo + 2], SEEK_SET);
+    /* Nothing left of the previous image to dispose; the keyframe covers
+     * the canvas, or is drawn on the background it was disposed to. */
+    memset(&gif->gce, 0, sizeof(gif->gce));
+    gif->fw = gif->fh = 0;
+    gif->palette = &gif->gct;
+    bgcolor = &gif->gct.colors[gif->bgindex*3];
+    for (i = 0; i < gif->width * gif->height; i++)
+        memcpy(&gif->canvas[i*3], bgcolor, 3);
+    return gif->seek[3 * lo];
 }
 
 void gd_close_gif(gd_GIF *gif) {
-    close(gif->fd);
+    if (gif->fd >= 0)
+        close(gif->fd);
+    free(gif->seek);
     free(gif);
 }
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -11,13 +12,26 @@
 #else
 #include <unistd.h>
 #endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 // Enable if you want the automatic color space calculated in HSV instead of RBG mode
 // This might generate a better palette
 // #define HSV_MODE
 
+#ifdef HSV_MODE
+#define DEFAULT_SPACE  GE_SPACE_HSV
+#else
+#define DEFAULT_SPACE  GE_SPACE_RGB
+#endif
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
 /* helper to write a little-endian 16-bit number portably */
-#define write_num(fd, n) write((fd), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
+#define write_num(gif, n) put_bytes((gif), (uint8_t []) {(n) & 0xFF, (n) >> 8}, 2)
 
 // VGA colors
 static uint8_t vga[0x30] = {
@@ -69,21 +83,48 @@ static void del_trie(Node *root, int degree) {
     free(root);
 }
 
-#define write_and_store(s, dst, fd, src, n) \
-do { \
-    write(fd, src, n); \
-    if (s) { \
-        memcpy(dst, src, n); \
-        dst += n; \
-    } \
-} while (0);
-
 static void put_loop(ge_GIF *gif, uint16_t loop);
 
+/* All output goes through here. Bytes are counted in gif->nbytes; a handle
+ * without a file (fd < 0) only counts them, for dry-run size estimates, or
+ * with ge_Options.memory keeps them in gif->mem. */
+static void put_bytes(ge_GIF *gif, const void *buf, size_t n)
+{
+    uint8_t *mem;
+    size_t cap;
+
+    if (gif->fd >= 0) {
+        write(gif->fd, buf, n);
+    } else if (gif->opt.memory && !gif->memErr) {
+        if (gif->nbytes + n > gif->memCap) {
+            cap = MAX(2 * gif->memCap, gif->nbytes + n + 0x1000);
+            mem = realloc(gif->mem, cap);
+            if (!mem) {
+                gif->memErr = 1;
+                gif->nbytes += n;
+                return;
+            }
+            gif->mem = mem;
+            gif->memCap = cap;
+        }
+        memcpy(&gif->mem[gif->nbytes], buf, n);
+    }
+    gif->nbytes += n;
+}
+
 ge_GIF *ge_new_gif2(const char *fname, uint16_t width, uint16_t height,
                uint8_t *palette, int depth, int loop) {
+    return ge_new_gif_opt(fname, width, height, palette, depth, loop, NULL);
+}
+
+/* Same as ge_new_gif2(), with encoder options. opt may be NULL; it is copied
+ * into the handle. A NULL fname makes a dry-run handle that writes nothing
+ * and only counts the output size in gif->nbytes. */
+ge_GIF *ge_new_gif_opt(const char *fname, uint16_t width, uint16_t height,
+               uint8_t *palette, int depth, int loop, const ge_Options *opt) {
     int i, r, g, b, v;
     int store_gct, custom_gct;
+    uint8_t *dst;
     
     // Adjust the palette size to log base 2
     if      ( depth <= 4)   {depth = 2;}
@@ -94,25 +135,47 @@ ge_GIF *ge_new_gif2(const char *fname, uint16_t width, uint16_t height,
     else if ( depth <= 128) {depth = 7;}
     else                    {depth = 8;}
     
-    ge_GIF *gif = calloc(1, sizeof(*gif) + 2*width*height);
+    int tw = (width + GE_TILE - 1) / GE_TILE;
+    int th = (height + GE_TILE - 1) / GE_TILE;
+    /* Merged frames leave the caller free to reuse buffers the encoder still
+     * diffs against, so it keeps copies of its own. */
+    size_t copies = opt && (opt->merge || opt->adapt) ? 2 * (size_t) width * height : 0;
+    /* Frames are owned by the caller; only the diff scratch lives here. */
+    ge_GIF *gif = calloc(1, sizeof(*gif) + tw*th + height + copies);
     if (!gif)
         goto no_gif;
     gif->w = width; gif->h = height;
-    gif->frame = (uint8_t *) &gif[1];
-    gif->back = &gif->frame[width*height];
+    gif->tw = tw; gif->th = th;
+    if (opt)
+        gif->opt = *opt;
+    gif->max_rects = gif->opt.rects > 1 ? MIN(gif->opt.rects, GE_MAX_RECTS) : 1;
+    if (gif->opt.level == GE_LEVEL_DEFAULT)
+        gif->opt.level = GE_LEVEL_NORMAL;
+    gif->tiles = (uint8_t *) &gif[1];
+    gif->rows = &gif->tiles[tw*th];
+    gif->delay_at = -1;
+    if (!fname || gif->opt.memory) {
+        gif->fd = -1;   /* dry run, or in memory */
+    } else {
 #ifdef _WIN32
-    gif->fd = creat(fname, S_IWRITE);
+        gif->fd = creat(fname, S_IWRITE);
 #else
-    gif->fd = creat(fname, 0666);
+        gif->fd = creat(fname, 0666);
 #endif
-    if (gif->fd == -1)
-        goto no_fd;
+        if (gif->fd == -1)
+            goto no_fd;
 #ifdef _WIN32
-    setmode(gif->fd, O_BINARY);
+        setmode(gif->fd, O_BINARY);
 #endif
-    write(gif->fd, "GIF89a", 6);
-    write_num(gif->fd, width);
-    write_num(gif->fd, height);
+    }
+    /* Merging rewrites the delay of the frame before, so needs to seek. */
+    if (copies && (gif->fd < 0 || lseek(gif->fd, 0, SEEK_CUR) >= 0)) {
+        gif->prev = &gif->rows[height];
+        gif->pending = &gif->prev[(size_t) width * height];
+    }
+    put_bytes(gif, "GIF89a", 6);
+    write_num(gif, width);
+    write_num(gif, height);
     store_gct = custom_gct = 0;
     if (palette) {
         if (depth < 0)
@@ -123,20 +186,20 @@ ge_GIF *ge_new_gif2(const char *fname, uint16_t width, uint16_t height,
     if (depth < 0)
         depth = -depth;
     gif->depth = depth > 1 ? depth : 2;
-    write(gif->fd, (uint8_t []) {0xF0 | (depth-1), 0x00, 0x00}, 3);
+    put_bytes(gif, (uint8_t []) {0xF0 | (depth-1), 0x00, 0x00}, 3);
+    dst = gif->gct;
     if (custom_gct) {
-        write(gif->fd, palette, 3 << depth);
+        memcpy(dst, palette, 3 << depth);
     } else if (depth <= 4) {
-        write_and_store(store_gct, palette, gif->fd, vga, 3 << depth);
+        memcpy(dst, vga, 3 << depth);
     } else {
-        write_and_store(store_gct, palette, gif->fd, vga, sizeof(vga));
+        memcpy(dst, vga, sizeof(vga));
+        dst += sizeof(vga);
         i = 0x10;
         for (r = 0; r < 6; r++) {
             for (g = 0; g < 6; g++) {
                 for (b = 0; b < 6; b++) {
-                    write_and_store(store_gct, palette, gif->fd,
-                      ((uint8_t []) {r*51, g*51, b*51}), 3
-                    );
+                    *dst++ = r*51; *dst++ = g*51; *dst++ = b*51;
                     if (++i == 1 << depth)
                         goto done_gct;
                 }
@@ -144,12 +207,14 @@ ge_GIF *ge_new_gif2(const char *fname, uint16_t width, uint16_t height,
         }
         for (i = 1; i <= 24; i++) {
             v = i * 0xFF / 25;
-            write_and_store(store_gct, palette, gif->fd,
-              ((uint8_t []) {v, v, v}), 3
-            );
+            *dst++ = v; *dst++ = v; *dst++ = v;
         }
     }
 done_gct:
+    gif->gct_depth = depth;
+    put_bytes(gif, gif->gct, 3 << depth);
+    if (store_gct)
+        memcpy(palette, gif->gct, 3 << depth);
     if (loop >= 0 && loop <= 0xFFFF)
         put_loop(gif, (uint16_t) loop);
     return gif;
@@ -160,11 +225,11 @@ no_gif:
 }
 
 static void put_loop(ge_GIF *gif, uint16_t loop) {
-    write(gif->fd, (uint8_t []) {'!', 0xFF, 0x0B}, 3);
-    write(gif->fd, "NETSCAPE2.0", 11);
-    write(gif->fd, (uint8_t []) {0x03, 0x01}, 2);
-    write_num(gif->fd, loop);
-    write(gif->fd, "\0", 1);
+    put_bytes(gif, (uint8_t []) {'!', 0xFF, 0x0B}, 3);
+    put_bytes(gif, "NETSCAPE2.0", 11);
+    put_bytes(gif, (uint8_t []) {0x03, 0x01}, 2);
+    write_num(gif, loop);
+    put_bytes(gif, "\0", 1);
 }
 
 /* Add packed key to buffer, updating offset and partial.
@@ -180,8 +245,8 @@ static void put_key(ge_GIF *gif, uint16_t key, int key_size)
     while (bits_to_write >= 8) {
         gif->buffer[byte_offset++] = gif->partial & 0xFF;
         if (byte_offset == 0xFF) {
-            write(gif->fd, "\xFF", 1);
-            write(gif->fd, gif->buffer, 0xFF);
+            put_bytes(gif, "\xFF", 1);
+            put_bytes(gif, gif->buffer, 0xFF);
             byte_offset = 0;
         }
         gif->partial >>= 8;
@@ -197,66 +262,548 @@ static void end_key(ge_GIF *gif)
     if (gif->offset % 8)
         gif->buffer[byte_offset++] = gif->partial & 0xFF;
     if (byte_offset) {
-        write(gif->fd, (uint8_t []) {byte_offset}, 1);
-        write(gif->fd, gif->buffer, byte_offset);
+        put_bytes(gif, (uint8_t []) {byte_offset}, 1);
+        put_bytes(gif, gif->buffer, byte_offset);
     }
-    write(gif->fd, "\0", 1);
+    put_bytes(gif, "\0", 1);
     gif->offset = gif->partial = 0;
 }
 
-static void put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
+/* Encode the pixels with literal codes only: no dictionary is built, and a
+ * clear code is sent before the decoder's table would force wider codes (one
+ * code early, so decoders that widen codes eagerly stay in step).
+ * Fastest level, at the cost of roughly (depth+1)/8 bytes per pixel. */
+static void put_store(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y,
+                      int depth)
 {
-    int nkeys, key_size, i, j;
+    int i, j, n;
+    int degree = 1 << depth;
+    int key_size = depth + 1;
+    const uint8_t *row;
+
+    put_key(gif, degree, key_size); /* clear code */
+    n = 0;
+    for (i = y; i < y+h; i++) {
+        row = &gif->frame[i*gif->w];
+        for (j = x; j < x+w; j++) {
+            if (n == degree - 3) {
+                put_key(gif, degree, key_size); /* clear code */
+                n = 0;
+            }
+            put_key(gif, row[j] & (degree - 1), key_size);
+            n++;
+        }
+    }
+    put_key(gif, degree + 1, key_size); /* stop code */
+}
+
+/* Adaptive reset: once the dictionary is full it is kept (deferred clear)
+ * and the bits spent per pixel are measured over windows of RATIO_WINDOW
+ * codes. The dictionary is cleared as soon as a window costs more than the
+ * average of the phase that filled it, which is about what a fresh
+ * dictionary would cost again. */
+#define RATIO_WINDOW 256
+
+static void put_lzw(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y,
+                    int depth)
+{
+    int nkeys, key_size, i, j, k;
     Node *node, *child, *root;
-    int degree = 1 << gif->depth;
-
-    write(gif->fd, ",", 1);
-    write_num(gif->fd, x);
-    write_num(gif->fd, y);
-    write_num(gif->fd, w);
-    write_num(gif->fd, h);
-    write(gif->fd, (uint8_t []) {0x00, gif->depth}, 2);
+    int degree = 1 << depth;
+    int adaptive = gif->opt.level == GE_LEVEL_ADAPTIVE;
+    int lossy = gif->opt.lossy > 0;
+    long npix, nbits, ncodes, fill_pix, fill_bits;
+
     root = node = new_trie(degree, &nkeys);
-    key_size = gif->depth + 1;
+    key_size = depth + 1;
+    npix = nbits = ncodes = fill_pix = fill_bits = 0;
     put_key(gif, degree, key_size); /* clear code */
     for (i = y; i < y+h; i++) {
         for (j = x; j < x+w; j++) {
             uint8_t pixel = gif->frame[i*gif->w+j] & (degree - 1);
+            npix++;
             child = node->children[pixel];
+            if (!child && lossy) {
+                /* Extend the match with a close enough color instead. */
+                for (k = 0; k < gif->nnear[pixel] && !child; k++)
+                    if (gif->near[pixel][k] < degree)
+                        child = node->children[gif->near[pixel][k]];
+            }
             if (child) {
                 node = child;
-            } else {
-                put_key(gif, node->key, key_size);
-                if (nkeys < 0x1000) {
-                    if (nkeys == (1 << key_size))
-                        key_size++;
-                    node->children[pixel] = new_node(nkeys++, degree);
-                } else {
+                continue;
+            }
+            put_key(gif, node->key, key_size);
+            nbits += key_size;
+            if (nkeys < 0x1000) {
+                if (nkeys == (1 << key_size))
+                    key_size++;
+                node->children[pixel] = new_node(nkeys++, degree);
+                if (nkeys == 0x1000) {
+                    /* npix counts the pixel starting the next code too. */
+                    fill_pix = npix - 1;
+                    fill_bits = nbits;
+                    npix = 1;
+                    nbits = ncodes = 0;
+                }
+            } else if (!adaptive) {
+                put_key(gif, degree, key_size); /* clear code */
+                del_trie(root, degree);
+                root = node = new_trie(degree, &nkeys);
+                key_size = depth + 1;
+            } else if (++ncodes == RATIO_WINDOW) {
+                if (nbits * fill_pix > fill_bits * (npix - 1)) {
                     put_key(gif, degree, key_size); /* clear code */
                     del_trie(root, degree);
                     root = node = new_trie(degree, &nkeys);
-                    key_size = gif->depth + 1;
+                    key_size = depth + 1;
                 }
-                node = root->children[pixel];
+                npix = 1;
+                nbits = ncodes = 0;
             }
+            node = root->children[pixel];
         }
     }
     put_key(gif, node->key, key_size);
     put_key(gif, degree + 1, key_size); /* stop code */
-    end_key(gif);
     del_trie(root, degree);
 }
 
+/* Bits needed by the largest index in a rectangle, at least 2 (the smallest
+ * LZW code size) and at most depth. Rectangles that only use the first
+ * entries of the color table get shorter codes. */
+static int used_depth(const ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y,
+                      int depth)
+{
+    int i, j, used = 2;
+    uint8_t top = 0;
+    const uint8_t *row;
+
+    for (i = y; i < y+h && used < depth; i++) {
+        row = &gif->frame[i*gif->w];
+        for (j = x; j < x+w; j++)
+            top |= row[j];
+        while (used < depth && top >= (1 << used))
+            used++;
+    }
+    return used;
+}
+
+/* Write one image block. If the frame has a local color table
+ * (gif->lct_depth != 0) it is stored in the block; the minimum LZW code size
+ * is the one the rectangle's largest index needs. */
+static void put_image(ge_GIF *gif, uint16_t w, uint16_t h, uint16_t x, uint16_t y)
+{
+    int depth = gif->lct_depth ? MAX(gif->lct_depth, 2) : gif->depth;
+
+    depth = used_depth(gif, w, h, x, y, depth);
+
+    put_bytes(gif, ",", 1);
+    write_num(gif, x);
+    write_num(gif, y);
+    write_num(gif, w);
+    write_num(gif, h);
+    if (gif->lct_depth) {
+        put_bytes(gif, (uint8_t []) {0x80 | (gif->lct_depth-1)}, 1);
+        put_bytes(gif, gif->pal, 3 << gif->lct_depth);
+    } else {
+        put_bytes(gif, "\0", 1);
+    }
+    put_bytes(gif, (uint8_t []) {depth}, 1);
+    if (gif->opt.level == GE_LEVEL_STORE)
+        put_store(gif, w, h, x, y, depth);
+    else
+        put_lzw(gif, w, h, x, y, depth);
+    end_key(gif);
+}
+
+/* Frame differencing.
+ * first_diff() returns the index of the first byte where a and b differ, or n
+ * if they are equal; last_diff() returns the index of the last one, or -1.
+ * Both compare 16 (SSE2) or 32 (AVX2) bytes per step when available. */
+#ifdef GE_X86_SIMD
+/* 0: scalar only, 1: SSE2, 2: AVX2 */
+static int simd_level(void)
+{
+    static int level = -1;
+    if (level < 0) {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 :
+                __builtin_cpu_supports("sse2") ? 1 : 0;
+    }
+    return level;
+}
+
+__attribute__((target("avx2")))
+static int first_diff_avx2(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+    uint32_t m;
+    for (i = 0; i + 32 <= n; i += 32) {
+        m = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+              _mm256_loadu_si256((const __m256i *) &a[i]),
+              _mm256_loadu_si256((const __m256i *) &b[i])));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    for (; i < n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int last_diff_avx2(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+    uint32_t m;
+    for (i = n; i >= 32; i -= 32) {
+        m = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+              _mm256_loadu_si256((const __m256i *) &a[i-32]),
+              _mm256_loadu_si256((const __m256i *) &b[i-32])));
+        if (m)
+            return i - 1 - __builtin_clz(m);
+    }
+    for (i--; i >= 0 && a[i] == b[i]; i--)
+        ;
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int first_diff_sse2(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+    uint32_t m;
+    for (i = 0; i + 16 <= n; i += 16) {
+        m = 0xFFFF ^ (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) &a[i]),
+              _mm_loadu_si128((const __m128i *) &b[i])));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    for (; i < n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int last_diff_sse2(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+    uint32_t m;
+    for (i = n; i >= 16; i -= 16) {
+        m = 0xFFFF ^ (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(
+              _mm_loadu_si128((const __m128i *) &a[i-16]),
+              _mm_loadu_si128((const __m128i *) &b[i-16])));
+        if (m)
+            return i - 16 + 31 - __builtin_clz(m);
+    }
+    for (i--; i >= 0 && a[i] == b[i]; i--)
+        ;
+    return i;
+}
+#endif
+
+static int first_diff(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+#ifdef GE_X86_SIMD
+    switch (simd_level()) {
+    case 2: return first_diff_avx2(a, b, n);
+    case 1: return first_diff_sse2(a, b, n);
+    }
+#endif
+    for (i = 0; i < n && a[i] == b[i]; i++)
+        ;
+    return i;
+}
+
+static int last_diff(const uint8_t *a, const uint8_t *b, int n)
+{
+    int i;
+#ifdef GE_X86_SIMD
+    switch (simd_level()) {
+    case 2: return last_diff_avx2(a, b, n);
+    case 1: return last_diff_sse2(a, b, n);
+    }
+#endif
+    for (i = n - 1; i >= 0 && a[i] == b[i]; i--)
+        ;
+    return i;
+}
+
+/* Bounding box of the pixels that differ between frame and back.
+ * Unchanged rows above and below the changes are skipped with whole-row
+ * compares, and inside the changed band only the columns left of the current
+ * left bound and right of the current right bound are examined.
+ * gif->rows[i] is set to 1 for every row that changed, 0 otherwise. */
 static int get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t *y)
 {
+    int i, f, l, r;
+    int left, right, top, bottom;
+    const uint8_t *a, *b;
+
+    memset(gif->rows, 0, gif->h);
+    left = gif->w;
+    for (top = 0; top < gif->h; top++) {
+        left = first_diff(&gif->frame[top*gif->w], &gif->back[top*gif->w], gif->w);
+        if (left < gif->w)
+            break;
+    }
+    if (top == gif->h)
+        return 0;
+    right = last_diff(&gif->frame[top*gif->w], &gif->back[top*gif->w], gif->w);
+    gif->rows[top] = 1;
+    for (bottom = gif->h - 1; bottom > top; bottom--) {
+        a = &gif->frame[bottom*gif->w];
+        b = &gif->back[bottom*gif->w];
+        if ((f = first_diff(a, b, gif->w)) < gif->w) {
+            gif->rows[bottom] = 1;
+            left = MIN(left, f);
+            right = MAX(right, last_diff(a, b, gif->w));
+            break;
+        }
+    }
+    for (i = top + 1; i < bottom; i++) {
+        a = &gif->frame[i*gif->w];
+        b = &gif->back[i*gif->w];
+        f = first_diff(a, b, gif->w);
+        if (f == gif->w)
+            continue;
+        gif->rows[i] = 1;
+        left = MIN(left, f);
+        if (right < gif->w - 1) {
+            l = MAX(f, right + 1);
+            r = last_diff(&a[l], &b[l], gif->w - l);
+            if (r >= 0)
+                right = l + r;
+        }
+    }
+    *x = left; *y = top;
+    *w = right - left + 1;
+    *h = bottom - top + 1;
+    return 1;
+}
+
+/* Graphic control extension: the delay, and with ge_Options.transparent the
+ * transparent index and disposal to background instead of leaving the image
+ * in place. */
+static void set_delay(ge_GIF *gif, uint16_t d) {
+    int t = gif->opt.transparent;
+
+    put_bytes(gif, (uint8_t []) {'!', 0xF9, 0x04, t ? 0x09 : 0x04}, 4);
+    gif->delay_at = gif->nbytes;
+    write_num(gif, d);
+    put_bytes(gif, (uint8_t []) {t ? t - 1 : 0, 0}, 2);
+}
+
+/* Rewrite the delay of the last frame written, in place. */
+static void patch_delay(ge_GIF *gif, uint16_t d) {
+    gif->delay = d;
+    if (gif->delay_at < 0)
+        return;
+    if (gif->mem && !gif->memErr) {
+        gif->mem[gif->delay_at] = d & 0xFF;
+        gif->mem[gif->delay_at + 1] = d >> 8;
+    }
+    if (gif->fd < 0)
+        return;
+    lseek(gif->fd, gif->delay_at, SEEK_SET);
+    write(gif->fd, (uint8_t []) {d & 0xFF, d >> 8}, 2);
+    lseek(gif->fd, 0, SEEK_END);
+}
+
+typedef struct Rect {
+    uint16_t x, y, w, h;
+} Rect;
+
+/* Estimated size in bytes of one image block covering r: descriptor, code
+ * size, clear/stop codes and terminator, plus a 2:1 LZW ratio on the pixels.
+ * Extra rectangles also carry their own zero-delay GCE when the frame has a
+ * delay. */
+#define RECT_OVERHEAD 24
+static long rect_cost(ge_GIF *gif, const Rect *r)
+{
+    return RECT_OVERHEAD + (long) r->w * r->h * gif->depth / 16;
+}
+
+static Rect rect_union(const Rect *a, const Rect *b)
+{
+    Rect u;
+    u.x = MIN(a->x, b->x);
+    u.y = MIN(a->y, b->y);
+    u.w = MAX(a->x + a->w, b->x + b->w) - u.x;
+    u.h = MAX(a->y + a->h, b->y + b->h) - u.y;
+    return u;
+}
+
+/* Do a and b overlap or touch once grown by one unit on every side? */
+static int rect_near(const Rect *a, const Rect *b)
+{
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+/* Mark the tiles inside bbox that contain at least one changed pixel.
+ * Rows that get_bbox() found unchanged are skipped. */
+static void diff_tiles(ge_GIF *gif, const Rect *bbox)
+{
+    int i, tx, x0, x1;
+    uint8_t *dirty;
+
+    memset(gif->tiles, 0, gif->tw * gif->th);
+    for (i = bbox->y; i < bbox->y + bbox->h; i++) {
+        if (!gif->rows[i])
+            continue;
+        dirty = &gif->tiles[(i / GE_TILE) * gif->tw];
+        for (tx = bbox->x / GE_TILE; tx * GE_TILE < bbox->x + bbox->w; tx++) {
+            if (dirty[tx])
+                continue;
+            x0 = MAX(tx * GE_TILE, bbox->x);
+            x1 = MIN((tx + 1) * GE_TILE, bbox->x + bbox->w);
+            if (memcmp(&gif->frame[i*gif->w + x0], &gif->back[i*gif->w + x0], x1 - x0))
+                dirty[tx] = 1;
+        }
+    }
+}
+
+/* Shrink r (in pixels) to the exact bounds of the changed pixels inside it. */
+static void tighten_rect(ge_GIF *gif, Rect *r)
+{
+    int i, f, l;
+    int left, right, top, bottom;
+    const uint8_t *a, *b;
+    left = r->x + r->w; right = -1;
+    top = r->y + r->h; bottom = r->y;
+    for (i = r->y; i < r->y + r->h; i++) {
+        if (!gif->rows[i])
+            continue;
+        a = &gif->frame[i*gif->w + r->x];
+        b = &gif->back[i*gif->w + r->x];
+        if ((f = first_diff(a, b, r->w)) == r->w)
+            continue;
+        l = last_diff(a, b, r->w);
+        if (f < left)   left    = f;
+        if (l > right)  right   = l;
+        if (i < top)    top     = i;
+        bottom = i;
+    }
+    r->x += left; r->y = top;
+    r->w = right - left + 1;
+    r->h = bottom - top + 1;
+}
+
+/* Find up to gif->max_rects disjoint changed regions between frame and back.
+ * Dirty tiles are grouped into connected regions, then regions are merged
+ * greedily for as long as merging does not increase the estimated output
+ * size (or there are too many of them).
+ * Return the number of rectangles; 0 if nothing changed. */
+static int get_rects(ge_GIF *gif, Rect *rects)
+{
+    Rect boxes[4 * GE_MAX_RECTS], bbox, t, u;
+    int nboxes, tx, ty, i, j, bi, bj, merged;
+    long delta, best;
+
+    if (!get_bbox(gif, &bbox.w, &bbox.h, &bbox.x, &bbox.y))
+        return 0;
+    /* Too small to be worth splitting. */
+    if (gif->max_rects <= 1 || rect_cost(gif, &bbox) < 2 * RECT_OVERHEAD) {
+        rects[0] = bbox;
+        return 1;
+    }
+    diff_tiles(gif, &bbox);
+    /* Group dirty tiles into bounding boxes, in tile units. */
+    nboxes = 0;
+    for (ty = 0; ty < gif->th; ty++) {
+        for (tx = 0; tx < gif->tw; tx++) {
+            if (!gif->tiles[ty*gif->tw + tx])
+                continue;
+            t = (Rect) {tx, ty, 1, 1};
+            for (i = 0; i < nboxes && !rect_near(&boxes[i], &t); i++)
+                ;
+            if (i == nboxes && nboxes == sizeof(boxes) / sizeof(boxes[0])) {
+                /* Out of boxes: grow the one that stays smallest. */
+                best = -1;
+                for (j = 0; j < nboxes; j++) {
+                    u = rect_union(&boxes[j], &t);
+                    delta = (long) u.w * u.h - (long) boxes[j].w * boxes[j].h;
+                    if (best < 0 || delta < best) {
+                        best = delta;
+                        i = j;
+                    }
+                }
+            }
+            if (i == nboxes)
+                boxes[nboxes++] = t;
+            else
+                boxes[i] = rect_union(&boxes[i], &t);
+        }
+    }
+    /* Growing boxes may have made them touch each other. */
+    do {
+        merged = 0;
+        for (i = 0; i < nboxes; i++) {
+            for (j = i + 1; j < nboxes; j++) {
+                if (rect_near(&boxes[i], &boxes[j])) {
+                    boxes[i] = rect_union(&boxes[i], &boxes[j]);
+                    boxes[j--] = boxes[--nboxes];
+                    merged = 1;
+                }
+            }
+        }
+    } while (merged);
+    /* Convert to pixels and drop the unchanged margins of each box. */
+    for (i = 0; i < nboxes; i++) {
+        boxes[i].x *= GE_TILE;
+        boxes[i].y *= GE_TILE;
+        boxes[i].w = MIN(boxes[i].w * GE_TILE, gif->w - boxes[i].x);
+        boxes[i].h = MIN(boxes[i].h * GE_TILE, gif->h - boxes[i].y);
+        tighten_rect(gif, &boxes[i]);
+    }
+    /* Merge the pair that saves the most bytes until no merge pays off. */
+    while (nboxes > 1) {
+        bi = 0; bj = 1;
+        best = LONG_MAX;
+        for (i = 0; i < nboxes; i++) {
+            for (j = i + 1; j < nboxes; j++) {
+                u = rect_union(&boxes[i], &boxes[j]);
+                delta = rect_cost(gif, &u) - rect_cost(gif, &boxes[i])
+                      - rect_cost(gif, &boxes[j]);
+                if (delta < best) {
+                    best = delta;
+                    bi = i; bj = j;
+                }
+            }
+        }
+        if (best > 0 && nboxes <= MIN(gif->max_rects, GE_MAX_RECTS))
+            break;
+        boxes[bi] = rect_union(&boxes[bi], &boxes[bj]);
+        boxes[bj] = boxes[--nboxes];
+    }
+    memcpy(rects, boxes, nboxes * sizeof(Rect));
+    return nboxes;
+}
+
+/* Bounding box of the pixels whose *color* changed, for frames whose color
+ * table differs from the previous frame's (same index != same color). */
+static int get_bbox_rgb(ge_GIF *gif, const uint8_t *cur, int cdepth,
+                        const uint8_t *prev, int pdepth, Rect *r)
+{
+    uint32_t ccol[0x100], pcol[0x100];
     int i, j, k;
     int left, right, top, bottom;
+
+    for (i = 0; i < 0x100; i++) {
+        k = 3 * (i & ((1 << cdepth) - 1));
+        ccol[i] = cur[k] | cur[k+1] << 8 | (uint32_t) cur[k+2] << 16;
+        k = 3 * (i & ((1 << pdepth) - 1));
+        pcol[i] = prev[k] | prev[k+1] << 8 | (uint32_t) prev[k+2] << 16;
+    }
     left = gif->w; right = 0;
     top = gif->h; bottom = 0;
     k = 0;
     for (i = 0; i < gif->h; i++) {
         for (j = 0; j < gif->w; j++, k++) {
-            if (gif->frame[k] != gif->back[k]) {
+            if (ccol[gif->frame[k]] != pcol[gif->back[k]]) {
                 if (j < left)   left    = j;
                 if (j > right)  right   = j;
                 if (i < top)    top     = i;
@@ -264,48 +811,285 @@ static int get_bbox(ge_GIF *gif, uint16_t *w, uint16_t *h, uint16_t *x, uint16_t
             }
         }
     }
-    if (left != gif->w && top != gif->h) {
-        *x = left; *y = top;
-        *w = right - left + 1;
-        *h = bottom - top + 1;
-        return 1;
-    } else {
+    if (left == gif->w)
         return 0;
+    *r = (Rect) {left, top, right - left + 1, bottom - top + 1};
+    return 1;
+}
+
+/* Lossy mode: for every color of the frame's table, list the other entries
+ * whose perceptual distance is within gif->opt.lossy, nearest first.
+ * The distance weighs green most and red least, like the eye does. */
+static void find_near_colors(ge_GIF *gif, const uint8_t *colors, int depth)
+{
+    int a, b, k, n, dr, dg, db;
+    long d, dist[GE_LOSSY_NEAR];
+    long limit = 9L * gif->opt.lossy * gif->opt.lossy;
+
+    for (a = 0; a < (1 << depth); a++) {
+        n = 0;
+        for (b = 0; b < (1 << depth); b++) {
+            /* Never trade a color for the transparent one or back */
+            if (b == a || gif->opt.transparent == a + 1 || gif->opt.transparent == b + 1)
+                continue;
+            dr = colors[3*a]   - colors[3*b];
+            dg = colors[3*a+1] - colors[3*b+1];
+            db = colors[3*a+2] - colors[3*b+2];
+            d = 2L*dr*dr + 4L*dg*dg + 3L*db*db;
+            if (d > limit || (n == GE_LOSSY_NEAR && d >= dist[n-1]))
+                continue;
+            /* Insertion into the short sorted list. */
+            k = n < GE_LOSSY_NEAR ? n++ : n - 1;
+            for (; k > 0 && dist[k-1] > d; k--) {
+                dist[k] = dist[k-1];
+                gif->near[a][k] = gif->near[a][k-1];
+            }
+            dist[k] = d;
+            gif->near[a][k] = b;
+        }
+        gif->nnear[a] = n;
     }
+    memset(&gif->nnear[1 << depth], 0, 0x100 - (1 << depth));
 }
 
-static void set_delay(ge_GIF *gif, uint16_t d) {
-    write(gif->fd, (uint8_t []) {'!', 0xF9, 0x04, 0x04}, 4);
-    write_num(gif->fd, d);
-    write(gif->fd, "\0\0", 2);
+/* Keyframes: remember where the next image starts and when it shows. */
+static void add_key(ge_GIF *gif)
+{
+    uint32_t *keys;
+
+    if (gif->nkeys == gif->capkeys) {
+        keys = realloc(gif->keys, 3 * sizeof(*keys) * (gif->capkeys + 64));
+        if (!keys)
+            return;     /* seeking just lands on an earlier keyframe */
+        gif->keys = keys;
+        gif->capkeys += 64;
+    }
+    keys = &gif->keys[3 * gif->nkeys++];
+    keys[0] = gif->nimages;
+    keys[1] = gif->clock;
+    keys[2] = gif->nbytes;
 }
 
-void ge_add_frame(ge_GIF *gif, uint16_t delay) {
-    uint16_t w, h, x, y;
-    uint8_t *tmp;
-
-    if (delay)
-        set_delay(gif, delay);
-    if (gif->nframes == 0) {
-        w = gif->w;
-        h = gif->h;
-        x = y = 0;
-    } else if (!get_bbox(gif, &w, &h, &x, &y)) {
+/* Seek index extension, see GE_SEEK_APP. */
+static void put_seek_index(ge_GIF *gif)
+{
+    uint8_t block[1 + 255];
+    uint32_t v, start = gif->nbytes;
+    int i, j, k, n;
+
+    put_bytes(gif, (uint8_t []) {'!', 0xFF, 0x0B}, 3);
+    put_bytes(gif, GE_SEEK_APP, 11);
+    for (i = 0; i < gif->nkeys; i += n) {
+        n = MIN(gif->nkeys - i, 255 / GE_SEEK_ENTRY);
+        block[0] = n * GE_SEEK_ENTRY;
+        for (j = 0; j < 3 * n; j++) {
+            v = gif->keys[3 * i + j];
+            for (k = 0; k < 4; k++)
+                block[1 + 4 * j + k] = v >> (8 * k);
+        }
+        put_bytes(gif, block, 1 + block[0]);
+    }
+    put_bytes(gif, (uint8_t []) {4, start & 0xFF, (start >> 8) & 0xFF,
+                                 (start >> 16) & 0xFF, start >> 24, 0}, 6);
+}
+
+/* Write gif->frame with the color table colors of the given depth. */
+static void put_frame(ge_GIF *gif, const uint8_t *colors, int depth, uint16_t delay)
+{
+    Rect rects[GE_MAX_RECTS];
+    int i, n;
+    long area;
+
+    if (gif->opt.lossy > 0 && gif->opt.level != GE_LEVEL_STORE)
+        find_near_colors(gif, colors, depth);
+    if (gif->nframes == 0 || gif->frame == gif->back || gif->opt.transparent) {
+        /* No previous frame to diff against (or the caller reused its
+         * buffer in place, or the frame is disposed before the next one
+         * is drawn): store the whole canvas. */
+        rects[0] = (Rect) {0, 0, gif->w, gif->h};
+        n = 1;
+    } else if (depth == gif->ppal_depth && !memcmp(colors, gif->ppal, 3 << depth)) {
+        n = get_rects(gif, rects);
+    } else {
+        n = get_bbox_rgb(gif, colors, depth, gif->ppal, gif->ppal_depth, rects);
+    }
+    if (!n) {
         /* image's not changed; save one pixel just to add delay */
-        w = h = 1;
-        x = y = 0;
+        rects[0] = (Rect) {0, 0, 1, 1};
+        n = 1;
+    }
+    if (gif->nframes)
+        gif->clock += gif->delay;
+    if (gif->opt.keyframe) {
+        /* A keyframe is one opaque image of the whole canvas, so decoding
+         * can start there; scene changes cost about as much anyway. */
+        for (area = 0, i = 0; i < n; i++)
+            area += (long) rects[i].w * rects[i].h;
+        if (gif->nframes % gif->opt.keyframe == 0 || 2 * area >= (long) gif->w * gif->h) {
+            rects[0] = (Rect) {0, 0, gif->w, gif->h};
+            n = 1;
+            add_key(gif);
+        }
     }
-    put_image(gif, w, h, x, y);
+    /* The frame delay applies once its last rectangle is drawn. */
+    gif->delay = delay;
+    gif->delay_at = -1;
+    for (i = 0; i < n; i++) {
+        if (delay || gif->opt.transparent)
+            set_delay(gif, i == n - 1 ? delay : 0);
+        put_image(gif, rects[i].w, rects[i].h, rects[i].x, rects[i].y);
+    }
+    gif->nimages += n;
     gif->nframes++;
-    tmp = gif->back;
-    gif->back = gif->frame;
-    gif->frame = tmp;
+    memcpy(gif->ppal, colors, 3 << depth);
+    gif->ppal_depth = depth;
+    gif->has_pending = 0;
+    if (gif->prev) {
+        memcpy(gif->prev, gif->frame, (size_t) gif->w * gif->h);
+        gif->back = gif->prev;
+    } else {
+        /* Keep a reference only: the caller must not modify this buffer
+         * until the next frame has been added. */
+        gif->back = gif->frame;
+    }
+}
+
+/* Temporal merging: drop gif->frame and add its delay to the frame written
+ * before it.  Identical frames and frames with fewer than opt.merge changed
+ * pixels are merged; with opt.adapt so are frames changing less than a
+ * quarter of the canvas, as long as the frame before has been shown for less
+ * than a time that shrinks as the change grows.  Changes of a merged frame
+ * show with the next frame written.
+ * Return 1 if the frame was merged. */
+static int merge_frame(ge_GIF *gif, const uint8_t *colors, int depth, uint16_t delay)
+{
+    Rect r;
+    long changed = 0, limit, npix = (long) gif->w * gif->h;
+    int i, x;
+    const uint8_t *a, *b;
+
+    if (gif->nframes == 0 || depth != gif->ppal_depth || memcmp(colors, gif->ppal, 3 << depth))
+        return 0;
+    /* The new delay must fit, and have a GCE to go in. */
+    if (gif->delay + delay > 0xFFFF || (delay && gif->delay_at < 0))
+        return 0;
+    limit = gif->opt.adapt ? MAX(npix / 4, gif->opt.merge) : gif->opt.merge;
+    if (get_bbox(gif, &r.w, &r.h, &r.x, &r.y)) {
+        for (i = r.y; i < r.y + r.h && changed < limit; i++) {
+            if (!gif->rows[i])
+                continue;
+            a = &gif->frame[i*gif->w];
+            b = &gif->back[i*gif->w];
+            for (x = r.x; x < r.x + r.w; x++)
+                changed += a[x] != b[x];
+        }
+        if (changed >= limit)
+            return 0;
+        if (changed >= gif->opt.merge &&
+            gif->delay + delay > gif->opt.adapt * (1.0 - 4.0 * changed / npix))
+            return 0;
+    }
+    patch_delay(gif, gif->delay + delay);
+    if (changed) {
+        memcpy(gif->pending, gif->frame, npix);
+        gif->pending_delay = delay;
+    }
+    gif->has_pending = changed > 0;
+    gif->nmerged++;
+    return 1;
+}
+
+/* Add gif->frame, using the local color table in gif->pal if
+ * gif->lct_depth != 0 or the global one otherwise. */
+static void add_frame(ge_GIF *gif, uint16_t delay)
+{
+    const uint8_t *colors;
+    int depth;
+
+    /* No frame given: the handle has no buffer of its own to fall back on. */
+    if (!gif->frame)
+        return;
+    if (gif->lct_depth) {
+        colors = gif->pal;
+        depth = gif->lct_depth;
+    } else {
+        colors = gif->gct;
+        depth = gif->gct_depth;
+    }
+    if (gif->prev && merge_frame(gif, colors, depth, delay))
+        return;
+    put_frame(gif, colors, depth, delay);
+}
+
+void ge_add_frame(ge_GIF *gif, uint16_t delay) {
+    gif->lct_depth = 0;
+    add_frame(gif, delay);
+}
+
+void ge_add_frame_buf(ge_GIF *gif, const uint8_t *frame, uint16_t delay) {
+    gif->frame = frame;
+    ge_add_frame(gif, delay);
+}
+
+/* palette holds ncolors RGB triplets (1..256); the table written to the file
+ * is padded with black up to the next power of two. A NULL palette selects
+ * the global color table. */
+void ge_add_frame_lct(ge_GIF *gif, const uint8_t *frame, uint16_t delay,
+                      const uint8_t *palette, int ncolors) {
+    int depth;
+
+    gif->frame = frame;
+    gif->lct_depth = 0;
+    if (palette && ncolors > 0) {
+        ncolors = MIN(ncolors, 0x100);
+        for (depth = 1; (1 << depth) < ncolors; depth++)
+            ;
+        memcpy(gif->pal, palette, 3 * ncolors);
+        memset(&gif->pal[3 * ncolors], 0, 3 * ((1 << depth) - ncolors));
+        gif->lct_depth = depth;
+    }
+    add_frame(gif, delay);
 }
 
 void ge_close_gif(ge_GIF* gif) {
-    write(gif->fd, ";", 1);
-    close(gif->fd);
+    size_t size;
+
+    free(ge_close_gif_mem(gif, &size));
+}
+
+/* Same as ge_close_gif(); with ge_Options.memory the file is returned, for
+ * the caller to free(), and its length stored in *size.  NULL if it was not
+ * kept in memory or did not fit. */
+uint8_t *ge_close_gif_mem(ge_GIF *gif, size_t *size) {
+    uint8_t *mem;
+
+    if (gif->has_pending) {
+        /* The last frames were merged with changes: give the latest one
+         * back its own delay rather than lose what it shows. */
+        patch_delay(gif, gif->delay - gif->pending_delay);
+        gif->frame = gif->pending;
+        gif->lct_depth = 0;
+        if (gif->ppal_depth != gif->gct_depth || memcmp(gif->ppal, gif->gct, 3 << gif->gct_depth)) {
+            memcpy(gif->pal, gif->ppal, 3 << gif->ppal_depth);
+            gif->lct_depth = gif->ppal_depth;
+        }
+        put_frame(gif, gif->lct_depth ? gif->pal : gif->gct, gif->ppal_depth,
+                  gif->pending_delay);
+    }
+    if (gif->opt.keyframe && gif->nkeys)
+        put_seek_index(gif);
+    put_bytes(gif, ";", 1);
+    if (gif->fd >= 0)
+        close(gif->fd);
+    mem = gif->mem;
+    if (gif->memErr) {
+        free(mem);
+        mem = NULL;
+    }
+    *size = mem ? gif->nbytes : 0;
+    free(gif->keys);
     free(gif);
+    return mem;
 }
 
 
@@ -346,10 +1130,162 @@ uint8_t pallatize64( pixel pix ) {
    return ((r << 4) | (g <<2 ) | b);
 }
 
+/* Fixed palettes matching pallatize64() (2 bits per channel) and
+ * pallatize256() (3 bits red and green, 2 bits blue); levels are spread
+ * from 0 to 255 so black and white are exact. */
+#define PAL64(i)   {((i) >> 4) * 85, (((i) >> 2) & 3) * 85, ((i) & 3) * 85}
+#define PAL256(i)  {((i) >> 5) * 255 / 7, (((i) >> 2) & 7) * 255 / 7, ((i) & 3) * 85}
+#define REP4(M, i)   M(i), M((i) + 1), M((i) + 2), M((i) + 3)
+#define REP16(M, i)  REP4(M, i), REP4(M, (i) + 4), REP4(M, (i) + 8), REP4(M, (i) + 12)
+#define REP64(M, i)  REP16(M, i), REP16(M, (i) + 16), REP16(M, (i) + 32), REP16(M, (i) + 48)
+
+const pixel ge_palette64[64] = { REP64(PAL64, 0) };
+const pixel ge_palette256[256] = {
+   REP64(PAL256, 0), REP64(PAL256, 64), REP64(PAL256, 128), REP64(PAL256, 192)
+};
+
+/* Batch conversion: the scalar code is the reference, the SIMD versions
+ * split 16 (SSSE3) or 32 (AVX2) packed RGB pixels into R, G and B vectors
+ * with byte shuffles and build the indices with shifts and masks. */
+static void pallatize_row(const uint8_t *rgb, int n, uint8_t *index, int bits)
+{
+   int i;
+   for (i = 0; i < n; i++, rgb += 3) {
+      if (bits == 6)
+         index[i] = (rgb[0] >> 6) << 4 | (rgb[1] >> 6) << 2 | rgb[2] >> 6;
+      else
+         index[i] = (rgb[0] & 0xE0) | (rgb[1] >> 3 & 0x1C) | rgb[2] >> 6;
+   }
+}
+
+#ifdef GE_X86_SIMD
+/* pshufb masks gathering R, G then B of 16 pixels from the three 16 byte
+ * blocks holding them */
+static const int8_t deinterleave[9][16] = {
+   { 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13},
+   { 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14},
+   { 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15},
+};
+
+static int has_ssse3(void)
+{
+   static int level = -1;
+   if (level < 0) {
+      __builtin_cpu_init();
+      level = __builtin_cpu_supports("ssse3");
+   }
+   return level;
+}
+
+__attribute__((target("ssse3")))
+static int pallatize_ssse3(const uint8_t *rgb, int n, uint8_t *index, int bits)
+{
+   int i, k;
+   __m128i m[9], a, b, c, ch[3], hi2 = _mm_set1_epi8((char)0xC0), x;
+
+   for (i = 0; i < 9; i++)
+      m[i] = _mm_loadu_si128((const __m128i *)deinterleave[i]);
+   for (i = 0; i + 16 <= n; i += 16, rgb += 48) {
+      a = _mm_loadu_si128((const __m128i *)rgb);
+      b = _mm_loadu_si128((const __m128i *)(rgb + 16));
+      c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+      for (k = 0; k < 3; k++)
+         ch[k] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, m[3*k]),
+                 _mm_shuffle_epi8(b, m[3*k+1])), _mm_shuffle_epi8(c, m[3*k+2]));
+      if (bits == 6) {
+         x = _mm_or_si128(_mm_srli_epi16(_mm_and_si128(ch[0], hi2), 2),
+                          _mm_srli_epi16(_mm_and_si128(ch[1], hi2), 4));
+         x = _mm_or_si128(x, _mm_srli_epi16(_mm_and_si128(ch[2], hi2), 6));
+      } else {
+         x = _mm_and_si128(ch[0], _mm_set1_epi8((char)0xE0));
+         x = _mm_or_si128(x, _mm_and_si128(_mm_srli_epi16(ch[1], 3), _mm_set1_epi8(0x1C)));
+         x = _mm_or_si128(x, _mm_srli_epi16(_mm_and_si128(ch[2], hi2), 6));
+      }
+      _mm_storeu_si128((__m128i *)(index + i), x);
+   }
+   return i;
+}
+
+__attribute__((target("avx2")))
+static int pallatize_avx2(const uint8_t *rgb, int n, uint8_t *index, int bits)
+{
+   int i, k;
+   __m256i m[9], a, b, c, ch[3], hi2 = _mm256_set1_epi8((char)0xC0), x;
+
+   for (i = 0; i < 9; i++)
+      m[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)deinterleave[i]));
+   /* Each 128 bit lane works on its own 16 pixels */
+   for (i = 0; i + 32 <= n; i += 32, rgb += 96) {
+      a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+             _mm_loadu_si128((const __m128i *)rgb)), _mm_loadu_si128((const __m128i *)(rgb + 48)), 1);
+      b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+             _mm_loadu_si128((const __m128i *)(rgb + 16))), _mm_loadu_si128((const __m128i *)(rgb + 64)), 1);
+      c = _mm256_inserti128_si256(_mm256_castsi128_si256(
+             _mm_loadu_si128((const __m128i *)(rgb + 32))), _mm_loadu_si128((const __m128i *)(rgb + 80)), 1);
+      for (k = 0; k < 3; k++)
+         ch[k] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, m[3*k]),
+                 _mm256_shuffle_epi8(b, m[3*k+1])), _mm256_shuffle_epi8(c, m[3*k+2]));
+      if (bits == 6) {
+         x = _mm256_or_si256(_mm256_srli_epi16(_mm256_and_si256(ch[0], hi2), 2),
+                             _mm256_srli_epi16(_mm256_and_si256(ch[1], hi2), 4));
+         x = _mm256_or_si256(x, _mm256_srli_epi16(_mm256_and_si256(ch[2], hi2), 6));
+      } else {
+         x = _mm256_and_si256(ch[0], _mm256_set1_epi8((char)0xE0));
+         x = _mm256_or_si256(x, _mm256_and_si256(_mm256_srli_epi16(ch[1], 3), _mm256_set1_epi8(0x1C)));
+         x = _mm256_or_si256(x, _mm256_srli_epi16(_mm256_and_si256(ch[2], hi2), 6));
+      }
+      _mm256_storeu_si256((__m256i *)(index + i), x);
+   }
+   return i;
+}
+#endif
+
+static void pallatize_buf(const uint8_t *rgb, size_t stride, int w, int h, uint8_t *index,
+                          int bits)
+{
+   int y, i;
+   for (y = 0; y < h; y++, rgb += stride, index += w) {
+      i = 0;
+#ifdef GE_X86_SIMD
+      if (simd_level() == 2)
+         i = pallatize_avx2(rgb, w, index, bits);
+      else if (has_ssse3())
+         i = pallatize_ssse3(rgb, w, index, bits);
+#endif
+      pallatize_row(rgb + 3 * i, w - i, index + i, bits);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  These functions convert a whole packed RGB image with pallatize64() or
+  pallatize256() into indices for ge_palette64 or ge_palette256.  Rows may
+  be padded; the index image is packed.
+
+   Where:   uint8_t *rgb         - first pixel, 3 bytes per pixel
+            size_t stride        - bytes from one row to the next, 3*w if
+                                   the rows are packed
+            int w, h             - image size, or npix, 1 for a pixel run
+            uint8_t *index       - receives w*h indices
+---------------------------------------------------------------------------*/
+void pallatize64_buf(const uint8_t *rgb, size_t stride, int w, int h, uint8_t *index) {
+   pallatize_buf(rgb, stride, w, h, index, 6);
+}
+
+void pallatize256_buf(const uint8_t *rgb, size_t stride, int w, int h, uint8_t *index) {
+   pallatize_buf(rgb, stride, w, h, index, 8);
+}
+
 /*---------------------------------------------------------------------------
   This function builds custom palette from an rgb pixel image.  It returns
   the number of items in the palette OR a negative number if the palette
-  size is exceeded.
+  size is exceeded.  Colors are counted with a hash histogram in a single
+  pass, and the palette lists them in order of first appearance.
 
    Where:   pixel *image  - Pointer to an image of pixels 
             int h
@@ -357,126 +1293,928 @@ uint8_t pallatize64( pixel pix ) {
             int palSize
             pixel *palette
    
-   Returns: uint_8 pallatized332 - a palette index between 0 and 63
-   int histogram(pixel **image, int h, int w, int palSize, pixel *palette) {
+   Returns: index of the last palette entry, or -palSize if the image has
+            more than palSize colors
 
-   Errors: none
+   Errors: out of memory is reported as too many colors
 ---------------------------------------------------------------------------*/
 int genPallette(pixel *image, int h, int w, int palSize, pixel *palette) {
-   int i,j,k;
-   int index = 0;
-   int found;
-   
-   // The first item always exists 
-   palette [0].r = image [0].r;
-   palette [0].g = image [0].g;
-   palette [0].b = image [0].b;
-   
-   // Process all the pixels in the image
-   for (i = 0; i < h; i++) {
-      for (j = 0; j < w; j++) {
-         
-         // is the item already in the list
-         found = 0;
-         for (k = 0; k <= index; k++) {
-            if ((palette [k].r == image [i*w+j].r) &&
-                (palette [k].g == image [i*w+j].g) &&
-                (palette [k].b == image [i*w+j].b)) { 
-             found = 1;
-             k = index;
-            }
-         } // k
-         if (found == 0) {
-            index++; 
-            // Check for too many items
-            if (index >= palSize) {
-               return(-1*index);
-               }
-            palette [index].r = image [i*w+j].r;
-            palette [index].g = image [i*w+j].g;
-            palette [index].b = image [i*w+j].b;
-         } // found
-      } // j
-   } // i
-   
-   return(index);
+   ge_Histogram *hist;
+   int i, n;
+
+   hist = ge_hist_new();
+   if (!hist) {
+      return(-1*palSize);
+   }
+   n = ge_hist_add(hist, image, h*w, palSize);
+   if (n < 0) {
+      ge_hist_free(hist);
+      return(-1*palSize);
+   }
+   for (i = 0; i < n; i++) {
+      palette [i].r = hist->colors[i] >> 16;
+      palette [i].g = hist->colors[i] >> 8;
+      palette [i].b = hist->colors[i];
+   }
+   ge_hist_free(hist);
+   return(n - 1);
 }
 
 
 /*---------------------------------------------------------------------------
-  This function takes a true color image and will resample it until it fits
-  in the pallet size provided.  It returns the pallet and the index color image
+  This function takes a true color image and reduces it to the pallet size
+  provided.  It returns the pallet and the index color image.
   
-   Where:   pixel *fRGBrame      - Pointer to the true color image, this may be modified
+   Where:   pixel *RGBframe      - Pointer to the true color image, not modified
             uint8_t *IndxFrame   - Pointer to the resulting index color image
             int w                - width of both images
             int h                - height of both images
             pixel *palette       - pointer to the returned palette
-            int palSize          - size of the palette
+            int palLen           - size of the palette
    
-   Returns: pallet size or negative for error
+   Returns: index of the last palette entry or negative for error
    
-   Errors: none
+   Errors: out of memory
 ---------------------------------------------------------------------------*/
 int createGIF(pixel *RGBframe, uint8_t *IndxFrame, int w, int h, pixel *palette, int palLen) {
-   uint8_t mask = 0xff;
-   int i, j, k, palSize; 
-   
-#ifdef HSV_MODE
+   return(createGIFex(RGBframe, IndxFrame, w, h, palette, palLen, NULL));
+}
+
+
+/* Row bands of one createGIFsrc() call, shared by its tasks. */
+typedef struct {
+   const ge_Source *src;
+   uint8_t *IndxFrame;
+   int w, h, nbands;
+   ge_Histogram **hists;      // one histogram per band while counting
+   const ge_Histogram *hist;  // histogram of an exact palette, else NULL
+   const ge_InvMap *inv;      // inverse colormap, nearest mapping
+   int dither;                // GE_DITHER_* for nearest mapping
+   int space;                 // GE_SPACE_* of the histogram
+   int tindex;                // index of transparent pixels, -1 for none
+   int err;                   // a band failed, set atomically by the tasks
+} QuantJob;
+
+/*---------------------------------------------------------------------------
+  These helpers give the rows of a band and the histogram key of a pixel in
+  the working color space.
+---------------------------------------------------------------------------*/
+static void bandRows(const QuantJob *job, int band, int *y0, int *y1) {
+   *y0 = (int)((long)job->h * band / job->nbands);
+   *y1 = (int)((long)job->h * (band + 1) / job->nbands);
+}
+
+static pixel workPixel(const QuantJob *job, pixel pix) {
    hsvPixel hsvTemp;
-   // convert to HSV space
-      for (i = 0; i < h; i++) {
-         for (j = 0; j < w; j++) {
-            hsvTemp = RGBtoHSV(RGBframe [i*w+j]);
-            RGBframe [i*w+j].r = hsvTemp.h;
-            RGBframe [i*w+j].g = hsvTemp.s;
-            RGBframe [i*w+j].b = hsvTemp.v;
-      } // End for i
-   } // End while
-#endif 
+
+   if (job->space == GE_SPACE_HSV) {
+      ge_rgb_to_hsv_buf(&pix, &hsvTemp, 1);
+      pix.r = hsvTemp.h;
+      pix.g = hsvTemp.s;
+      pix.b = hsvTemp.v;
+   }
+   return(pix);
+}
+
+/*---------------------------------------------------------------------------
+  This task counts the colors of one band.  Each row is read from the
+  source, converted if it is not packed RGB (and again if working in HSV),
+  and its runs of one color are counted.  Transparent pixels are not
+  counted.
+---------------------------------------------------------------------------*/
+static void countBand(void *arg, int band) {
+   QuantJob *job = arg;
+   ge_Histogram *hist = job->hists[band];
+   const pixel *src;
+   pixel *row, pix;
+   uint8_t *clear = NULL;
+   int i, j, y, y0, y1;
+
+   // A converted row, an HSV row and the transparency flags
+   row = malloc(job->w * (2 * sizeof(pixel) + 1));
+   if (!row) {
+      __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   if (job->tindex >= 0) {
+      clear = (uint8_t *)&row[2 * job->w];
+   }
+   bandRows(job, band, &y0, &y1);
+   for (y = y0; y < y1; y++) {
+      src = ge_source_row(job->src, job->w, y, row, clear);
+      if (job->space == GE_SPACE_HSV) {
+         // hsvPixel has the layout of pixel, so rows are counted the same way
+         ge_rgb_to_hsv_buf(src, (hsvPixel *)&row[job->w], job->w);
+         src = &row[job->w];
+      }
+      for (i = 0; i < job->w; i = j) {
+         pix = src [i];
+         for (j = i + 1; j < job->w && !memcmp(&src [j], &pix, sizeof(pixel)) &&
+                         (!clear || clear[j] == clear[i]); j++)
+            ;
+         if (clear && clear[i]) {
+            continue;
+         }
+         if (ge_hist_insert(hist, (pix.r << 16) | (pix.g << 8) | pix.b, j - i) < 0) {
+            __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+            break;
+         }
+      }
+   }
+   free(row);
+}
+
+/*---------------------------------------------------------------------------
+  This task maps the pixels of one band to palette indexes, exactly through
+  the histogram when the palette holds every counted color, or to the
+  nearest entry through the inverse colormap, with ordered dithering if
+  asked for.  Transparent pixels take job->tindex.
+---------------------------------------------------------------------------*/
+static void mapBand(void *arg, int band) {
+   QuantJob *job = arg;
+   const uint8_t *planes[3];
+   const pixel *src;
+   pixel *row;
+   uint8_t *out, *clear = NULL;
+   int i, j, k, y, y0, y1;
+
+   bandRows(job, band, &y0, &y1);
+   if (!job->hist && job->dither == GE_DITHER_ORDERED) {
+      if (ge_dither_ordered_src(job->inv, job->src, job->IndxFrame, job->w, y0, y1,
+                                job->tindex) < 0) {
+         __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+      }
+      return;
+   }
+   row = malloc(job->w * (sizeof(pixel) + 1));
+   if (!row) {
+      __atomic_store_n(&job->err, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   if (job->tindex >= 0) {
+      clear = (uint8_t *)&row[job->w];
+   }
+   for (y = y0; y < y1; y++) {
+      out = &job->IndxFrame [(long)y * job->w];
+      if (!job->hist && job->src->format == GE_FMT_PLANAR) {
+         // Planes are looked up as they are
+         ge_planar_rows(job->src, job->w, y, planes);
+         ge_invmap_apply_planar(job->inv, planes[0], planes[1], planes[2], out, job->w);
+         continue;
+      }
+      src = ge_source_row(job->src, job->w, y, row, clear);
+      if (!job->hist) {
+         ge_invmap_apply(job->inv, src, out, job->w);
+         for (i = 0; clear && i < job->w; i++) {
+            if (clear[i]) {
+               out [i] = job->tindex;
+            }
+         }
+         continue;
+      }
+      for (i = 0; i < job->w; i = j) {
+         for (j = i + 1; j < job->w && !memcmp(&src [j], &src [i], sizeof(pixel)) &&
+                         (!clear || clear[j] == clear[i]); j++)
+            ;
+         if (clear && clear[i]) {
+            k = job->tindex;
+         }
+         else if ((k = ge_hist_find(job->hist, workPixel(job, src [i]))) < 0) {
+            // Color never counted, take the nearest one
+            k = job->inv->table[GE_INV_INDEX(src [i])];
+         }
+         memset(&out [i], k, j - i);
+      }
+   }
+   free(row);
+}
+
+
+/*---------------------------------------------------------------------------
+  This function sets up the row bands of a frame: one band when working on
+  a single thread, otherwise two per thread but never more than rows.
+---------------------------------------------------------------------------*/
+static void initJob(QuantJob *job, const ge_Source *src, uint8_t *IndxFrame, int w, int h,
+                    const ge_QuantOpts *opt) {
+   memset(job, 0, sizeof(*job));
+   job->src = src;
+   job->IndxFrame = IndxFrame;
+   job->w = w;
+   job->h = h;
+   job->space = (opt && opt->space) ? opt->space : DEFAULT_SPACE;
+   job->tindex = -1;
+   job->nbands = 1;
+   if (opt && (opt->threads > 1 || opt->pool_run)) {
+      job->nbands = MIN(MAX(opt->threads, 2) * 2, GE_MAX_THREADS);
+      job->nbands = MAX(MIN(job->nbands, h), 1);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function adds the colors of a frame to a histogram.  Each band is
+  counted on its own and the band histograms are merged in order.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int countFrame(QuantJob *job, const ge_QuantOpts *opt, ge_Histogram *into) {
+   ge_Histogram *hists[GE_MAX_THREADS] = {NULL};
+   int i, ret = -1;
+
+   job->hists = hists;
+   job->err = 0;
+   hists[0] = into;
+   for (i = 1; i < job->nbands; i++) {
+      if (!(hists[i] = ge_hist_new())) {
+         goto done;
+      }
+   }
+   ge_run_tasks(opt, countBand, job, job->nbands);
+   if (job->err) {
+      goto done;
+   }
+   for (i = 1; i < job->nbands; i++) {
+      if (ge_hist_merge(into, hists[i]) < 0) {
+         goto done;
+      }
+   }
+   ret = 0;
+
+done:
+   for (i = 1; i < job->nbands; i++) {
+      ge_hist_free(hists[i]);
+   }
+   job->hists = NULL;
+   return(ret);
+}
+
+
+/*---------------------------------------------------------------------------
+  These functions are createGIF() with options.  The colors are counted in
+  one pass.  If they fit in the palette they are used exactly; otherwise a
+  median cut quantizer builds a palette of exactly palLen colors and every
+  pixel is mapped to its nearest entry through an inverse colormap.  With
+  opt->fixed the given palette is used and only the mapping is done.  An
+  inverse colormap in opt->invmap is only rebuilt when the palette changes,
+  so frames that share a palette pay for it once.  opt->space picks the
+  color space: GE_SPACE_OKLAB splits the colors and matches pixels by
+  perceptual distance.  opt->dither adds ordered
+  or Floyd-Steinberg dithering to the nearest entry mapping; images that fit
+  the palette are never dithered.
+
+  createGIFsrc() reads the frame through a ge_Source, so RGBA, BGRA and
+  I420 frames are converted a row at a time as they are counted and mapped.
+  With src->alpha_min set the entry after the colors (the last of a fixed
+  palette) is black and kept for transparent pixels; it is the returned
+  index.
+
+  Counting and mapping are split into row bands that run in parallel with
+  opt->threads threads or on opt->pool; the band histograms are merged in
+  band order so the palette does not depend on the thread count.
+  
+   Where:   pixel *RGBframe      - Pointer to the true color image, not modified
+            ge_Source *src       - or the source frame, not modified
+            uint8_t *IndxFrame   - Pointer to the resulting index color image
+            int w                - width of both images
+            int h                - height of both images
+            pixel *palette       - pointer to the returned (or fixed) palette
+            int palLen           - size of the palette
+            ge_QuantOpts *opt    - options, NULL for the defaults
+   
+   Returns: index of the last palette entry or negative for error
    
+   Errors: out of memory, no room for a transparent entry, a fixed palette
+           longer than MAX_PALETTE
+---------------------------------------------------------------------------*/
+int createGIFsrc(const ge_Source *src, uint8_t *IndxFrame, int w, int h, pixel *palette,
+                 int palLen, const ge_QuantOpts *opt) {
+   ge_Histogram *hist = NULL;
+   ge_InvMap *inv = opt ? opt->invmap : NULL;
+   QuantJob job;
+   int palSize = -1, reserve = src->alpha_min > 0;
+
+   // A fixed palette is copied into the inverse colormap as given
+   if (opt && opt->fixed && palLen > MAX_PALETTE) {
+      return(-1);
+   }
+   initJob(&job, src, IndxFrame, w, h, opt);
+   if (reserve) {
+      // Keep the last entry for transparent pixels
+      if (palLen < 2) {
+         return(-1);
+      }
+      palLen--;
+   }
+   if (opt && opt->fixed) {
+      palSize = palLen;
+      if (reserve) {
+         job.tindex = palLen;
+      }
+      goto mapping;
+   }
+
+   hist = ge_hist_new();
+   if (!hist || countFrame(&job, opt, hist) < 0) {
+      goto done;
+   }
+
    // build the palette
-   while ((palSize = genPallette(RGBframe, h, w, palLen, palette)) < 0) {
-      // Mask out the low bits.
-      mask = mask << 1;
-      
-      // remove  bits so the true color can fit in 256 bits 
-      for (i = 0; i < h; i++) {
-         for (j = 0; j < w; j++) {
-            RGBframe [i*w+j].r &= mask;
-            RGBframe [i*w+j].g &= mask;
-            RGBframe [i*w+j].b &= mask;
-         }  
-      } // End for i
-   } // End while
- 
- 
-   // Generate the palette and index image
-   for (i = 0; i < h; i++) {
-      for (j = 0; j < w; j++) {
-         // find the matching color
-         for (k = 0; k <= palSize; k++) {
-            // Search the color table for a match
-            if ((palette[k].r == RGBframe [i*w+j].r) &&
-                (palette[k].g == RGBframe [i*w+j].g) &&
-                (palette[k].b == RGBframe [i*w+j].b)) {
-               IndxFrame [i*w+j] = k;
-               k = palSize;
-            } // if
-         } // k
-      }// j
-   } // i
+   palSize = ge_quantize(hist, palLen, job.space, palette, NULL);
+   if (palSize < 0) {
+      goto done;
+   }
+   if (reserve) {
+      job.tindex = palSize;
+   }
+   if (hist->size <= palLen) {
+      // Exact colors, the palette is in histogram order
+      job.hist = hist;
+      ge_run_tasks(opt, mapBand, &job, job.nbands);
+   }
 
+   if (job.space == GE_SPACE_HSV) {
+      // Convert the HSV table back to rgb, hsvPixel has the layout of pixel
+      ge_hsv_to_rgb_buf((hsvPixel *)palette, palette, palSize);
+   }
+   if (reserve) {
+      palette [palSize] = (pixel) {0, 0, 0};
+   }
+   if (hist->size <= palLen) {
+      palSize = job.err ? -1 : palSize + reserve - 1;
+      goto done;
+   }
 
-#ifdef HSV_MODE
-   // Convert the HSV table back to rgb
-   for (k = 0; k <= palSize; k++) {
-      hsvTemp.h = palette [k].r;
-      hsvTemp.s = palette [k].g;
-      hsvTemp.v = palette [k].b;
-      palette[k] = HSVtoRGB(hsvTemp);
-   } // k
-#endif
+mapping:
+   // Map every pixel to its nearest palette entry
+   if (!inv && !(inv = ge_invmap_new())) {
+      palSize = -1;
+      goto done;
+   }
+   if (ge_invmap_set_space(inv, palette, palSize, job.space) < 0) {
+      palSize = -1;
+      goto done;
+   }
+   job.inv = inv;
+   job.dither = opt ? opt->dither : GE_DITHER_NONE;
+   if (job.dither == GE_DITHER_FS) {
+      if (ge_dither_fs_src(inv, src, IndxFrame, w, h, job.tindex, opt) < 0) {
+         palSize = -1;
+         goto done;
+      }
+   }
+   else {
+      ge_run_tasks(opt, mapBand, &job, job.nbands);
+   }
+   palSize = job.err ? -1 : palSize + reserve - 1;
 
+done:
+   if (inv && (!opt || inv != opt->invmap)) {
+      ge_invmap_free(inv);
+   }
+   ge_hist_free(hist);
    return(palSize);
 }
+
+int createGIFex(pixel *RGBframe, uint8_t *IndxFrame, int w, int h, pixel *palette, int palLen,
+                const ge_QuantOpts *opt) {
+   ge_Source src = {.format = GE_FMT_RGB, .plane = {(const uint8_t *)RGBframe}};
+
+   return(createGIFsrc(&src, IndxFrame, w, h, palette, palLen, opt));
+}
+
+
+/*---------------------------------------------------------------------------
+  This function starts a palette shared by all frames of an animation.
+
+   Where:   int palLen           - palette size, 1..MAX_PALETTE
+            int every            - temporal subsampling: only 1 of every
+                                   `every` frames is counted, 0 or 1 for all
+
+   Returns: the builder or NULL if out of memory
+---------------------------------------------------------------------------*/
+ge_PaletteBuilder *ge_palette_new(int palLen, int every) {
+   ge_PaletteBuilder *pb;
+
+   pb = calloc(1, sizeof(ge_PaletteBuilder));
+   if (!pb) {
+      return(NULL);
+   }
+   pb->hist = ge_hist_new();
+   pb->invmap = ge_invmap_new();
+   if (!pb->hist || !pb->invmap) {
+      ge_palette_free(pb);
+      return(NULL);
+   }
+   pb->palLen = MAX(MIN(palLen, MAX_PALETTE), 1);
+   pb->every = MAX(every, 1);
+   pb->space = DEFAULT_SPACE;
+   return(pb);
+}
+
+/*---------------------------------------------------------------------------
+  This function releases a palette builder.
+---------------------------------------------------------------------------*/
+void ge_palette_free(ge_PaletteBuilder *pb) {
+   if (pb) {
+      ge_hist_free(pb->hist);
+      ge_invmap_free(pb->invmap);
+      free(pb);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  These functions stream one frame into the animation's histogram.  Only
+  the counts are kept, so frames can be freed or reused right away.  A
+  source with alpha_min set reserves the palette's last entry for
+  transparent pixels.
+
+   Where:   ge_PaletteBuilder *pb - the builder
+            pixel *RGBframe      - the true color frame, not modified
+            ge_Source *src       - or the source frame, not modified
+            int w, h             - frame size
+            ge_QuantOpts *opt    - threads or pool to use, may be NULL
+
+   Returns: 1 if the frame was counted, 0 if skipped, -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_palette_add_src(ge_PaletteBuilder *pb, const ge_Source *src, int w, int h,
+                       const ge_QuantOpts *opt) {
+   QuantJob job;
+
+   if (src->alpha_min > 0) {
+      pb->transparent = 1;
+   }
+   if (pb->nframes++ % pb->every) {
+      return(0);
+   }
+   initJob(&job, src, NULL, w, h, opt);
+   job.space = pb->space;
+   if (src->alpha_min > 0) {
+      job.tindex = pb->palLen - 1;
+   }
+   if (countFrame(&job, opt, pb->hist) < 0) {
+      return(-1);
+   }
+   return(1);
+}
+
+int ge_palette_add(ge_PaletteBuilder *pb, const pixel *RGBframe, int w, int h,
+                   const ge_QuantOpts *opt) {
+   ge_Source src = {.format = GE_FMT_RGB, .plane = {(const uint8_t *)RGBframe}};
+
+   return(ge_palette_add_src(pb, &src, w, h, opt));
+}
+
+/*---------------------------------------------------------------------------
+  This function makes the shared palette and its inverse colormap from the
+  frames counted so far.  The palette is in pb->palette, with a black
+  transparent entry last if pb->transparent.
+
+   Returns: number of palette entries or negative for error
+---------------------------------------------------------------------------*/
+int ge_palette_build(ge_PaletteBuilder *pb) {
+   int n;
+
+   if (pb->hist->size == 0 && !pb->transparent) {
+      return(-1);
+   }
+   if (pb->transparent && pb->palLen < 2) {
+      return(-1);
+   }
+   n = ge_quantize(pb->hist, pb->palLen - pb->transparent, pb->space, pb->palette, NULL);
+   if (n < 0) {
+      return(n);
+   }
+   if (pb->space == GE_SPACE_HSV) {
+      // Convert the HSV table back to rgb, hsvPixel has the layout of pixel
+      ge_hsv_to_rgb_buf((hsvPixel *)pb->palette, pb->palette, n);
+   }
+   if (n > 0 && ge_invmap_set_space(pb->invmap, pb->palette, n, pb->space) < 0) {
+      return(-1);
+   }
+   if (pb->transparent) {
+      pb->palette[n++] = (pixel) {0, 0, 0};
+   }
+   pb->ncolors = n;
+   return(n);
+}
+
+/*---------------------------------------------------------------------------
+  These functions map a frame to the shared palette in one pass through the
+  cached inverse colormap.  Frames need not have been counted.  Threads and
+  dithering are taken from opt.  With a transparent entry in the palette,
+  pixels whose alpha is below src->alpha_min (or is 0) take it.
+
+   Where:   ge_PaletteBuilder *pb - a built palette
+            pixel *RGBframe      - the true color frame, not modified
+            ge_Source *src       - or the source frame, not modified
+            uint8_t *IndxFrame   - receives the index image
+            int w, h             - frame size
+            ge_QuantOpts *opt    - options, NULL for the defaults
+
+   Returns: index of the last palette entry or negative for error
+---------------------------------------------------------------------------*/
+int ge_palette_map_src(ge_PaletteBuilder *pb, const ge_Source *src, uint8_t *IndxFrame,
+                       int w, int h, const ge_QuantOpts *opt) {
+   ge_QuantOpts mopt = {0};
+   ge_Source tsrc = *src;
+
+   if (pb->ncolors == 0 || (src->alpha_min > 0 && !pb->transparent)) {
+      return(-1);
+   }
+   if (pb->transparent) {
+      tsrc.alpha_min = MAX(tsrc.alpha_min, 1);
+   }
+   if (opt) {
+      mopt = *opt;
+   }
+   mopt.fixed = 1;
+   mopt.invmap = pb->invmap;
+   mopt.space = pb->space;
+   if (pb->hist->size <= pb->ncolors - pb->transparent) {
+      // Every counted color is in the palette, keep them exact
+      QuantJob job;
+
+      initJob(&job, &tsrc, IndxFrame, w, h, opt);
+      job.space = pb->space;
+      job.hist = pb->hist;
+      job.inv = pb->invmap;
+      if (pb->transparent) {
+         job.tindex = pb->ncolors - 1;
+      }
+      ge_run_tasks(opt, mapBand, &job, job.nbands);
+      return(job.err ? -1 : pb->ncolors - 1);
+   }
+   return(createGIFsrc(&tsrc, IndxFrame, w, h, pb->palette, pb->ncolors, &mopt));
+}
+
+int ge_palette_map(ge_PaletteBuilder *pb, pixel *RGBframe, uint8_t *IndxFrame, int w, int h,
+                   const ge_QuantOpts *opt) {
+   ge_Source src = {.format = GE_FMT_RGB, .plane = {(const uint8_t *)RGBframe}};
+
+   return(ge_palette_map_src(pb, &src, IndxFrame, w, h, opt));
+}
+
+
+#define REORDER_TRIAL   (4)     // frames encoded per trial
+
+/*---------------------------------------------------------------------------
+  This function gives the position of a color along a 3D Hilbert curve
+  through the RGB cube (Skilling's transform), so colors close on the curve
+  are close in color.
+---------------------------------------------------------------------------*/
+static uint32_t hilbertKey(pixel pix) {
+   uint32_t x[3] = {pix.r, pix.g, pix.b}, key = 0, t, p, q;
+   int i, b;
+
+   // Undo the excess work, from the top bit down
+   for (q = 0x80; q > 1; q >>= 1) {
+      p = q - 1;
+      for (i = 0; i < 3; i++) {
+         if (x[i] & q) {
+            x[0] ^= p;
+         }
+         else {
+            t = (x[0] ^ x[i]) & p;
+            x[0] ^= t;
+            x[i] ^= t;
+         }
+      }
+   }
+   // Gray encode
+   x[1] ^= x[0];
+   x[2] ^= x[1];
+   t = 0;
+   for (q = 0x80; q > 1; q >>= 1) {
+      if (x[2] & q) {
+         t ^= q - 1;
+      }
+   }
+   for (i = 0; i < 3; i++) {
+      x[i] ^= t;
+   }
+   // Interleave the transposed bits
+   for (b = 7; b >= 0; b--) {
+      for (i = 0; i < 3; i++) {
+         key = (key << 1) | ((x[i] >> b) & 1);
+      }
+   }
+   return(key);
+}
+
+/*---------------------------------------------------------------------------
+  This function makes the palette permutation of one order: perm[new] is
+  the old index.  Insertion sort, palettes are at most 256 entries.
+---------------------------------------------------------------------------*/
+static void paletteOrder(const pixel *palette, int ncolors, const uint32_t *uses, int order,
+                         uint8_t *perm) {
+   uint32_t key[MAX_PALETTE], k;
+   int i, j, p;
+
+   for (i = 0; i < ncolors; i++) {
+      switch (order) {
+      case GE_ORDER_FREQ:
+         key[i] = ~uses[i];
+         break;
+      case GE_ORDER_LUMA:
+         key[i] = 299 * palette[i].r + 587 * palette[i].g + 114 * palette[i].b;
+         break;
+      case GE_ORDER_HILBERT:
+         key[i] = hilbertKey(palette[i]);
+         break;
+      default:
+         key[i] = i;
+      }
+   }
+   for (i = 0; i < ncolors; i++) {
+      p = i;
+      k = key[i];
+      for (j = i; j > 0 && key[perm[j - 1]] > k; j--) {
+         perm[j] = perm[j - 1];
+      }
+      perm[j] = p;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function encodes the trial frames in a given order without writing
+  anything.
+
+   Returns: encoded size in bytes or negative for error
+---------------------------------------------------------------------------*/
+static long trialSize(const pixel *palette, int ncolors, uint8_t **frames, int nframes,
+                      int w, int h, const uint8_t *perm) {
+   pixel pal[MAX_PALETTE] = {{0}};
+   uint8_t remap[MAX_PALETTE], *buf[2];
+   ge_GIF *gif;
+   long size = -1;
+   int i, k;
+
+   for (i = 0; i < MAX_PALETTE; i++) {
+      remap[i] = i;
+   }
+   for (i = 0; i < ncolors; i++) {
+      pal[i] = palette[perm[i]];
+      remap[perm[i]] = i;
+   }
+   gif = ge_new_gif2(NULL, w, h, (uint8_t *)pal, ncolors, 0);
+   buf[0] = malloc((size_t)w * h);
+   buf[1] = malloc((size_t)w * h);
+   if (gif && buf[0] && buf[1]) {
+      for (k = 0; k < nframes; k++) {
+         for (i = 0; i < w * h; i++) {
+            buf[k & 1][i] = remap[frames[k][i]];
+         }
+         ge_add_frame_buf(gif, buf[k & 1], 0);
+      }
+      size = gif->nbytes;
+   }
+   if (gif) {
+      ge_close_gif(gif);
+   }
+   free(buf[0]);
+   free(buf[1]);
+   return(size);
+}
+
+/*---------------------------------------------------------------------------
+  This function reorders a palette and remaps the index frames using it.
+  The encoder sizes each image's LZW codes from the largest index it uses,
+  so an order that keeps the indices of changed regions low gives smaller
+  frames.  With GE_ORDER_AUTO every order is tried on the first frames
+  with a dry run and the smallest is kept; the current order wins ties.
+
+   Where:   pixel *palette       - the palette, reordered in place
+            int ncolors          - palette entries
+            uint8_t **frames     - index frames using the palette, remapped
+                                   in place
+            int nframes          - number of frames
+            int w, h             - frame size
+            int order            - GE_ORDER_*
+
+   Returns: the order applied or negative for error
+
+   Errors: out of memory
+---------------------------------------------------------------------------*/
+int ge_reorder_palette(pixel *palette, int ncolors, uint8_t **frames, int nframes,
+                       int w, int h, int order) {
+   uint32_t uses[MAX_PALETTE] = {0};
+   uint8_t perm[MAX_PALETTE], remap[MAX_PALETTE];
+   pixel pal[MAX_PALETTE];
+   long size, best = -1;
+   int i, k, o, n = MIN(nframes, REORDER_TRIAL);
+
+   if (ncolors < 2 || ncolors > MAX_PALETTE) {
+      return(ncolors < 2 ? GE_ORDER_NONE : -1);
+   }
+   for (k = 0; k < nframes; k++) {
+      for (i = 0; i < w * h; i++) {
+         uses[frames[k][i]]++;
+      }
+   }
+   if (order == GE_ORDER_AUTO) {
+      for (o = GE_ORDER_NONE; o <= GE_ORDER_HILBERT; o++) {
+         paletteOrder(palette, ncolors, uses, o, perm);
+         size = trialSize(palette, ncolors, frames, n, w, h, perm);
+         if (size < 0) {
+            return(-1);
+         }
+         if (best < 0 || size < best) {
+            best = size;
+            order = o;
+         }
+      }
+   }
+
+   // Apply the chosen order
+   paletteOrder(palette, ncolors, uses, order, perm);
+   for (i = 0; i < MAX_PALETTE; i++) {
+      remap[i] = i;
+   }
+   for (i = 0; i < ncolors; i++) {
+      pal[i] = palette[perm[i]];
+      remap[perm[i]] = i;
+   }
+   memcpy(palette, pal, ncolors * sizeof(pixel));
+   for (k = 0; k < nframes; k++) {
+      for (i = 0; i < w * h; i++) {
+         frames[k][i] = remap[frames[k][i]];
+      }
+   }
+   return(order);
+}
+
+
+/*---------------------------------------------------------------------------
+  This function quantizes one true color frame on its own and adds it to the
+  GIF with a local color table, so frames that use few colors are written
+  with smaller LZW codes.
+
+   Where:   ge_GIF *gif          - the GIF being written
+            pixel *RGBframe      - Pointer to the true color frame, not modified
+            uint8_t *IndxFrame   - Pointer to the index image (w*h), owned by
+                                   the caller and kept until the next frame
+            uint16_t delay       - frame delay in hundredths of a second
+            int palLen           - maximum number of colors for this frame
+
+   Returns: number of colors in the frame's table or negative for error
+
+   Errors: none
+---------------------------------------------------------------------------*/
+int ge_add_rgb_frame(ge_GIF *gif, pixel *RGBframe, uint8_t *IndxFrame,
+                     uint16_t delay, int palLen) {
+   pixel palette[MAX_PALETTE];
+   int last;
+
+   last = createGIF(RGBframe, IndxFrame, gif->w, gif->h, palette, palLen);
+   if (last < 0) {
+      return(last);
+   }
+   ge_add_frame_lct(gif, IndxFrame, delay, (uint8_t *)palette, last + 1);
+   return(last + 1);
+}
+
+
+/* Settings tried by ge_encode_budget(), from best looking to smallest. */
+static const struct {
+   int palSize, lossy, decimate;
+} rateLadder[] = {
+   {256,  0, 1}, {256, 10, 1}, {128, 10, 1}, {128, 20, 1},
+   { 64, 20, 1}, { 64, 30, 2}, { 32, 30, 2}, { 32, 40, 3},
+   { 16, 40, 3}, { 16, 60, 4}, {  8, 60, 4}, {  4, 80, 6},
+};
+#define RATE_STEPS     ((int)(sizeof(rateLadder) / sizeof(rateLadder[0])))
+#define RATE_SAMPLES   (6)    /* frame transitions measured per estimate */
+#define RATE_MARGIN    (95)   /* aim at this percentage of the budget */
+
+/*---------------------------------------------------------------------------
+  This function encodes frames with one rate ladder step.  With a NULL file
+  name nothing is written and the returned size is exact.  With sample > 0
+  only the first frame and up to sample transitions spread over the
+  animation are encoded, and the size is extrapolated.
+
+   Returns: size in bytes or negative for error
+---------------------------------------------------------------------------*/
+static long encodeStep(const char *fname, pixel **frames, int nframes, uint16_t w,
+                       uint16_t h, const uint16_t *delays, int loop, int step,
+                       int sample) {
+   ge_Options opt = {0};
+   ge_GIF *gif;
+   uint8_t *IndxFrame[2];
+   int dec = rateLadder[step].decimate;
+   int nout = (nframes + dec - 1) / dec;
+   int stride, i, j, k, n, cur = 0;
+   long first, total, delay;
+
+   opt.lossy = rateLadder[step].lossy;
+   // Every frame has its own color table: keep the unused global one small
+   gif = ge_new_gif_opt(fname, w, h, NULL, 2, loop, &opt);
+   IndxFrame[0] = malloc((size_t)w * h);
+   IndxFrame[1] = malloc((size_t)w * h);
+   if (!gif || !IndxFrame[0] || !IndxFrame[1]) {
+      total = -1;
+      goto done;
+   }
+
+   // Sampled transitions are spread evenly over the output frames
+   stride = (sample > 0 && nout > sample + 1) ? (nout - 1) / sample : 1;
+   first = 0;
+   n = 0;
+   for (i = 0; i < nout; i += stride) {
+      // With sampling, each measured transition restarts from its own
+      // previous frame so that the delta is the real one
+      for (k = (i > 0 && stride > 1) ? i - 1 : i; k <= i; k++) {
+         delay = 0;
+         for (j = k * dec; j < (k + 1) * dec && j < nframes; j++) {
+            delay += delays ? delays[j] : 0;
+         }
+         // The dropped frames' time, up to the longest delay a GIF holds
+         delay = MIN(delay, 0xFFFF);
+         if (k < i) {
+            // Only primes the encoder's previous frame, not counted
+            total = gif->nbytes;
+            ge_add_rgb_frame(gif, frames[k * dec], IndxFrame[cur], delay, rateLadder[step].palSize);
+            gif->nbytes = total;
+         }
+         else if (ge_add_rgb_frame(gif, frames[k * dec], IndxFrame[cur], delay,
+                                   rateLadder[step].palSize) < 0) {
+            total = -1;
+            goto done;
+         }
+         cur ^= 1;
+      }
+      if (i == 0) {
+         first = gif->nbytes;
+      }
+      else {
+         n++;
+      }
+   }
+   total = gif->nbytes;
+   if (n > 0 && nout - 1 > n) {
+      total = first + (total - first) * (nout - 1) / n;
+   }
+   total++;   // trailer
+
+done:
+   if (gif) {
+      ge_close_gif(gif);
+   }
+   free(IndxFrame[0]);
+   free(IndxFrame[1]);
+   return(total);
+}
+
+/*---------------------------------------------------------------------------
+  This function writes an animation that fits in a byte budget.  Every frame
+  is quantized on its own with a local color table.  The palette size, lossy
+  LZW threshold and frame decimation are picked from a fixed ladder: each
+  step's size is estimated with dry-run encodes of a few frame transitions,
+  which write nothing, and the best looking step that should fit is encoded
+  for real.  If it still does not fit, the next step is tried.
+
+   Where:   const char *fname    - GIF file to write
+            pixel **frames       - nframes true color frames, not modified
+            int nframes          - number of frames
+            uint16_t w, h        - frame size
+            uint16_t *delays     - per frame delays or NULL
+            int loop             - looping information, as for ge_new_gif2
+            long budget          - maximum file size in bytes
+            ge_Budget *result    - optional, receives the chosen settings
+
+   Returns: file size in bytes, or negative if nothing fits or for error
+
+   Errors: the file is left with the last attempt if nothing fits
+---------------------------------------------------------------------------*/
+long ge_encode_budget(const char *fname, pixel **frames, int nframes,
+                      uint16_t w, uint16_t h, const uint16_t *delays, int loop,
+                      long budget, ge_Budget *result) {
+   int step, passes = 0;
+   long size = -1;
+
+   if (nframes < 1) {
+      return(-1);
+   }
+   // Cheapest step expected to fit
+   for (step = 0; step < RATE_STEPS - 1; step++) {
+      size = encodeStep(NULL, frames, nframes, w, h, delays, loop, step, RATE_SAMPLES);
+      if (size >= 0 && size <= budget * RATE_MARGIN / 100) {
+         break;
+      }
+   }
+   // Full passes until it really fits
+   for (; step < RATE_STEPS; step++) {
+      passes++;
+      size = encodeStep(fname, frames, nframes, w, h, delays, loop, step, 0);
+      if (size >= 0 && size <= budget) {
+         break;
+      }
+   }
+   if (result) {
+      step = MIN(step, RATE_STEPS - 1);
+      result->palSize = rateLadder[step].palSize;
+      result->lossy = rateLadder[step].lossy;
+      result->decimate = rateLadder[step].decimate;
+      result->passes = passes;
+      result->bytes = size;
+   }
+   return((size >= 0 && size <= budget) ? size : -1);
+}
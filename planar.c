@@ -0,0 +1,383 @@
+/*---------------------------------------------------------------------------
+  Planar images: the R, G and B values of an image kept in three separate
+  planes instead of 3 byte pixels, with aligned and padded rows, so the
+  per pixel loops can load whole vectors of one channel.  This file holds
+  the container and the row kernels the quantizer and the decoder use on
+  it, each with a scalar version and an SSSE3 or AVX2 one picked at run
+  time.
+
+----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include "gifEncDec.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define ALIGN_UP(n)  (((n) + GE_PLANE_ALIGN - 1) & ~(size_t)(GE_PLANE_ALIGN - 1))
+
+/*---------------------------------------------------------------------------
+  This function allocates a planar image in one block.  Each row of each
+  plane starts on a GE_PLANE_ALIGN boundary and the stride is a multiple
+  of it, so kernels may read and write whole vectors past the width.
+
+   Where:   int w, h             - image size
+
+   Returns: the image, free it with ge_planar_free(); NULL if out of memory
+---------------------------------------------------------------------------*/
+ge_Planar *ge_planar_new(int w, int h) {
+   ge_Planar *img;
+   size_t stride, size;
+   uint8_t *base;
+   int i;
+
+   if (w <= 0 || h <= 0) {
+      return(NULL);
+   }
+   stride = ALIGN_UP((size_t)w);
+   size = stride * h;
+   img = malloc(ALIGN_UP(sizeof(ge_Planar)) + 3 * size + GE_PLANE_ALIGN);
+   if (!img) {
+      return(NULL);
+   }
+   base = (uint8_t *)ALIGN_UP((uintptr_t)img + sizeof(ge_Planar));
+   img->w = w;
+   img->h = h;
+   img->stride = (int)stride;
+   for (i = 0; i < 3; i++) {
+      img->plane[i] = base + i * size;
+   }
+   return(img);
+}
+
+void ge_planar_free(ge_Planar *img) {
+   free(img);
+}
+
+/*---------------------------------------------------------------------------
+  This function describes a planar image as a quantizer source.
+---------------------------------------------------------------------------*/
+void ge_planar_source(const ge_Planar *img, ge_Source *src) {
+   int i;
+
+   memset(src, 0, sizeof(*src));
+   src->format = GE_FMT_PLANAR;
+   for (i = 0; i < 3; i++) {
+      src->plane[i] = img->plane[i];
+      src->stride[i] = img->stride;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function finds row y of each plane of a GE_FMT_PLANAR source w
+  pixels wide; a stride of 0 means the plane is tightly packed.
+---------------------------------------------------------------------------*/
+void ge_planar_rows(const ge_Source *src, int w, int y, const uint8_t *rows[3]) {
+   int i;
+
+   for (i = 0; i < 3; i++) {
+      rows[i] = src->plane[i] + (size_t)y * (src->stride[i] ? src->stride[i] : w);
+   }
+}
+
+
+#ifdef GE_X86_SIMD
+/* 0: scalar only, 1: SSSE3, 2: AVX2 */
+static int simdLevel(void) {
+   static int level = -1;
+
+   if (level < 0) {
+      __builtin_cpu_init();
+      level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+   }
+   return(level);
+}
+
+/* pshufb masks: 16 pixels of each plane to 48 packed bytes and back.
+   Row 3 * c + j places plane j in packed chunk c, or chunk j in plane c. */
+static const int8_t packMask[9][16] = {
+   { 0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5},
+   {-1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1},
+   {-1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1},
+   {-1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1},
+   { 5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10},
+   {-1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1},
+   {-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+   {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+   {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15},
+};
+
+static const int8_t unpackMask[9][16] = {
+   { 0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13},
+   { 1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14},
+   { 2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1},
+   {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15},
+};
+
+#define MASK(t, i)  _mm_loadu_si128((const __m128i *)(t)[i])
+
+__attribute__((target("ssse3")))
+static int packSsse3(const uint8_t *r, const uint8_t *g, const uint8_t *b, int n,
+                     pixel *out) {
+   __m128i p[3], o;
+   uint8_t *dst = (uint8_t *)out;
+   int i, c;
+
+   for (i = 0; i + 16 <= n; i += 16) {
+      p[0] = _mm_loadu_si128((const __m128i *)&r[i]);
+      p[1] = _mm_loadu_si128((const __m128i *)&g[i]);
+      p[2] = _mm_loadu_si128((const __m128i *)&b[i]);
+      for (c = 0; c < 3; c++) {
+         o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p[0], MASK(packMask, 3 * c)),
+                                       _mm_shuffle_epi8(p[1], MASK(packMask, 3 * c + 1))),
+                          _mm_shuffle_epi8(p[2], MASK(packMask, 3 * c + 2)));
+         _mm_storeu_si128((__m128i *)&dst[3 * i + 16 * c], o);
+      }
+   }
+   return(i);
+}
+
+__attribute__((target("ssse3")))
+static int unpackSsse3(const pixel *in, int n, uint8_t *r, uint8_t *g, uint8_t *b) {
+   const uint8_t *src = (const uint8_t *)in;
+   uint8_t *dst[3] = {r, g, b};
+   __m128i p[3], o;
+   int i, c;
+
+   for (i = 0; i + 16 <= n; i += 16) {
+      for (c = 0; c < 3; c++) {
+         p[c] = _mm_loadu_si128((const __m128i *)&src[3 * i + 16 * c]);
+      }
+      for (c = 0; c < 3; c++) {
+         o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p[0], MASK(unpackMask, 3 * c)),
+                                       _mm_shuffle_epi8(p[1], MASK(unpackMask, 3 * c + 1))),
+                          _mm_shuffle_epi8(p[2], MASK(unpackMask, 3 * c + 2)));
+         _mm_storeu_si128((__m128i *)&dst[c][i], o);
+      }
+   }
+   return(i);
+}
+
+/*---------------------------------------------------------------------------
+  This helper maps 32 pixels through an inverse colormap.  The 5/6/5 bit
+  cell numbers are formed in 16 bit lanes and the table bytes are gathered
+  as the top byte of the dword ending at each cell; the 3 bytes before the
+  table belong to the palette copy in front of it, so no read leaves the
+  map.
+---------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static void lookup32Avx2(const ge_InvMap *inv, __m256i r, __m256i g, __m256i b, uint8_t *out) {
+   const int *base = (const int *)(inv->table - 3);
+   __m256i rw, gw, bw, key[2], v[4], zero = _mm256_setzero_si256();
+   int h;
+
+   for (h = 0; h < 2; h++) {
+      rw = h ? _mm256_unpackhi_epi8(r, zero) : _mm256_unpacklo_epi8(r, zero);
+      gw = h ? _mm256_unpackhi_epi8(g, zero) : _mm256_unpacklo_epi8(g, zero);
+      bw = h ? _mm256_unpackhi_epi8(b, zero) : _mm256_unpacklo_epi8(b, zero);
+      key[h] = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(rw, _mm256_set1_epi16(0xF8)), 8),
+               _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(gw, _mm256_set1_epi16(0xFC)), 3),
+                               _mm256_srli_epi16(bw, 3)));
+   }
+   // key[0] holds pixels 0-7 and 16-23, key[1] 8-15 and 24-31
+   v[0] = _mm256_unpacklo_epi16(key[0], zero);
+   v[1] = _mm256_unpackhi_epi16(key[0], zero);
+   v[2] = _mm256_unpacklo_epi16(key[1], zero);
+   v[3] = _mm256_unpackhi_epi16(key[1], zero);
+   for (h = 0; h < 4; h++) {
+      v[h] = _mm256_srli_epi32(_mm256_i32gather_epi32(base, v[h], 1), 24);
+   }
+   // Pack back: the unpacks above are undone by the packs in the same lanes
+   v[0] = _mm256_packus_epi32(v[0], v[1]);
+   v[2] = _mm256_packus_epi32(v[2], v[3]);
+   _mm256_storeu_si256((__m256i *)out, _mm256_packus_epi16(v[0], v[2]));
+}
+
+__attribute__((target("avx2")))
+static int applyAvx2(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                     const uint8_t *b, uint8_t *index, int n) {
+   int i;
+
+   for (i = 0; i + 32 <= n; i += 32) {
+      lookup32Avx2(inv, _mm256_loadu_si256((const __m256i *)&r[i]),
+                   _mm256_loadu_si256((const __m256i *)&g[i]),
+                   _mm256_loadu_si256((const __m256i *)&b[i]), &index[i]);
+   }
+   return(i);
+}
+
+__attribute__((target("avx2")))
+static int ditherAvx2(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                      const uint8_t *b, const int *off, uint8_t *index, int n) {
+   uint8_t pos[32], neg[32];
+   __m256i vp, vn;
+   int i;
+
+   // clamp255(v + d) is a saturating add of the positive part of d
+   // followed by a saturating subtract of the negative part
+   for (i = 0; i < 32; i++) {
+      pos[i] = off[i & 7] > 0 ? off[i & 7] : 0;
+      neg[i] = off[i & 7] < 0 ? -off[i & 7] : 0;
+   }
+   vp = _mm256_loadu_si256((const __m256i *)pos);
+   vn = _mm256_loadu_si256((const __m256i *)neg);
+   for (i = 0; i + 32 <= n; i += 32) {
+      lookup32Avx2(inv,
+         _mm256_subs_epu8(_mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)&r[i]), vp), vn),
+         _mm256_subs_epu8(_mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)&g[i]), vp), vn),
+         _mm256_subs_epu8(_mm256_adds_epu8(_mm256_loadu_si256((const __m256i *)&b[i]), vp), vn),
+         &index[i]);
+   }
+   return(i);
+}
+
+__attribute__((target("avx2")))
+static int lookupAvx2(const uint8_t *index, int n, const uint32_t *pal, int tindex,
+                      uint8_t *r, uint8_t *g, uint8_t *b) {
+   const __m256i split = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1,
+                                          0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1);
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   __m128i idx, rg, bb, keep;
+   __m256i c;
+   int i;
+
+   for (i = 0; i + 8 <= n; i += 8) {
+      idx = _mm_loadl_epi64((const __m128i *)&index[i]);
+      c = _mm256_i32gather_epi32((const int *)pal, _mm256_cvtepu8_epi32(idx), 4);
+      // RGB0 dwords to 8 reds, 8 greens and 8 blues
+      c = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(c, split), order);
+      rg = _mm256_castsi256_si128(c);
+      bb = _mm256_extracti128_si256(c, 1);
+      if (tindex >= 0) {
+         // Transparent pixels keep what is under them
+         keep = _mm_cmpeq_epi8(idx, _mm_set1_epi8((char)tindex));
+         bb = _mm_blendv_epi8(bb, _mm_loadl_epi64((const __m128i *)&b[i]), keep);
+         keep = _mm_unpacklo_epi64(keep, keep);
+         rg = _mm_blendv_epi8(rg, _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)&r[i]),
+                                                     _mm_loadl_epi64((const __m128i *)&g[i])),
+                              keep);
+      }
+      _mm_storel_epi64((__m128i *)&r[i], rg);
+      _mm_storel_epi64((__m128i *)&g[i], _mm_srli_si128(rg, 8));
+      _mm_storel_epi64((__m128i *)&b[i], bb);
+   }
+   return(i);
+}
+#endif
+
+/*---------------------------------------------------------------------------
+  These functions convert a row between planes and 3 byte pixels.
+
+   Where:   uint8_t *r, *g, *b   - the plane rows
+            pixel *pix           - the pixel row
+            int n                - pixels in the row
+---------------------------------------------------------------------------*/
+void ge_planar_pack(const uint8_t *r, const uint8_t *g, const uint8_t *b, int n, pixel *pix) {
+   int i = 0;
+
+#ifdef GE_X86_SIMD
+   if (simdLevel() >= 1) {
+      i = packSsse3(r, g, b, n, pix);
+   }
+#endif
+   for (; i < n; i++) {
+      pix[i].r = r[i];
+      pix[i].g = g[i];
+      pix[i].b = b[i];
+   }
+}
+
+void ge_planar_unpack(const pixel *pix, int n, uint8_t *r, uint8_t *g, uint8_t *b) {
+   int i = 0;
+
+#ifdef GE_X86_SIMD
+   if (simdLevel() >= 1) {
+      i = unpackSsse3(pix, n, r, g, b);
+   }
+#endif
+   for (; i < n; i++) {
+      r[i] = pix[i].r;
+      g[i] = pix[i].g;
+      b[i] = pix[i].b;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function maps a planar row to palette indexes through an inverse
+  colormap, like ge_invmap_apply().
+---------------------------------------------------------------------------*/
+void ge_invmap_apply_planar(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                            const uint8_t *b, uint8_t *index, int n) {
+   pixel pix;
+   int i = 0;
+
+#ifdef GE_X86_SIMD
+   if (simdLevel() == 2) {
+      i = applyAvx2(inv, r, g, b, index, n);
+   }
+#endif
+   for (; i < n; i++) {
+      pix.r = r[i];
+      pix.g = g[i];
+      pix.b = b[i];
+      index[i] = inv->table[GE_INV_INDEX(pix)];
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function maps a planar row with an ordered dither: off[x & 7] is
+  added to every channel of pixel x, clamped, before the lookup.
+---------------------------------------------------------------------------*/
+void ge_dither_row_planar(const ge_InvMap *inv, const uint8_t *r, const uint8_t *g,
+                          const uint8_t *b, const int *off, uint8_t *index, int n) {
+   pixel pix;
+   int i = 0, d;
+
+#ifdef GE_X86_SIMD
+   if (simdLevel() == 2) {
+      i = ditherAvx2(inv, r, g, b, off, index, n);
+   }
+#endif
+   for (; i < n; i++) {
+      d = off[i & 7];
+      pix.r = r[i] + d < 0 ? 0 : r[i] + d > 255 ? 255 : r[i] + d;
+      pix.g = g[i] + d < 0 ? 0 : g[i] + d > 255 ? 255 : g[i] + d;
+      pix.b = b[i] + d < 0 ? 0 : b[i] + d > 255 ? 255 : b[i] + d;
+      index[i] = inv->table[GE_INV_INDEX(pix)];
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function draws a row of palette indexes into plane rows.  Pixels
+  equal to tindex are left alone.
+
+   Where:   uint8_t *index       - the indexes
+            int n                - pixels in the row
+            uint32_t *pal        - 256 colors as r | g << 8 | b << 16
+            int tindex           - transparent index, -1 for none
+            uint8_t *r, *g, *b   - the plane rows
+---------------------------------------------------------------------------*/
+void ge_planar_lookup(const uint8_t *index, int n, const uint32_t *pal, int tindex,
+                      uint8_t *r, uint8_t *g, uint8_t *b) {
+   int i = 0;
+
+#ifdef GE_X86_SIMD
+   if (simdLevel() == 2) {
+      i = lookupAvx2(index, n, pal, tindex, r, g, b);
+   }
+#endif
+   for (; i < n; i++) {
+      if (index[i] != tindex) {
+         r[i] = pal[index[i]];
+         g[i] = pal[index[i]] >> 8;
+         b[i] = pal[index[i]] >> 16;
+      }
+   }
+}
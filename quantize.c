@@ -0,0 +1,1183 @@
+/*---------------------------------------------------------------------------
+  Color quantization helpers used to turn true color images into GIF index
+  images: an exact color histogram built in one pass over the pixels, a
+  median cut quantizer that reduces the histogram to a palette, and an
+  inverse colormap that maps pixels to their nearest palette entry, with
+  optional ordered or Floyd-Steinberg dithering.  Work that splits into row
+  bands is run on threads by ge_run_tasks().
+
+----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "gifEncDec.h"
+
+#define HIST_INIT_BITS  (10)    // initial hash table size, 1 << bits slots
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* 24 bit key of a pixel */
+#define PIX_KEY(p)  (((uint32_t)(p).r << 16) | ((uint32_t)(p).g << 8) | (p).b)
+
+static uint32_t hashKey(uint32_t key, int bits) {
+   return (key * 0x9E3779B1u) >> (32 - bits);
+}
+
+/*---------------------------------------------------------------------------
+  This function creates an empty color histogram.
+
+   Returns: the histogram or NULL if out of memory
+---------------------------------------------------------------------------*/
+ge_Histogram *ge_hist_new(void) {
+   ge_Histogram *hist = calloc(1, sizeof(*hist));
+
+   if (hist) {
+      hist->bits = HIST_INIT_BITS;
+      hist->slots = calloc((size_t)1 << hist->bits, sizeof(int32_t));
+      if (!hist->slots) {
+         free(hist);
+         hist = NULL;
+      }
+   }
+   return(hist);
+}
+
+/*---------------------------------------------------------------------------
+  This function releases a histogram.
+---------------------------------------------------------------------------*/
+void ge_hist_free(ge_Histogram *hist) {
+   if (hist) {
+      free(hist->slots);
+      free(hist->colors);
+      free(hist->counts);
+      free(hist);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function empties a histogram but keeps its memory for reuse.
+---------------------------------------------------------------------------*/
+void ge_hist_clear(ge_Histogram *hist) {
+   memset(hist->slots, 0, ((size_t)1 << hist->bits) * sizeof(int32_t));
+   hist->size = 0;
+}
+
+/*---------------------------------------------------------------------------
+  This function doubles the hash table once it is half full.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int growSlots(ge_Histogram *hist) {
+   int bits = hist->bits + 1;
+   int32_t *slots = calloc((size_t)1 << bits, sizeof(int32_t));
+   uint32_t mask = (1u << bits) - 1;
+   uint32_t s;
+   int i;
+
+   if (!slots) {
+      return(-1);
+   }
+   for (i = 0; i < hist->size; i++) {
+      for (s = hashKey(hist->colors[i], bits); slots[s]; s = (s + 1) & mask)
+         ;
+      slots[s] = i + 1;
+   }
+   free(hist->slots);
+   hist->slots = slots;
+   hist->bits = bits;
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function adds count pixels of one color to a histogram.
+
+   Returns: index of the color in hist->colors, -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_hist_insert(ge_Histogram *hist, uint32_t key, uint32_t count) {
+   uint32_t mask = (1u << hist->bits) - 1;
+   uint32_t s;
+   int32_t i;
+   void *p;
+
+   for (s = hashKey(key, hist->bits); (i = hist->slots[s]) != 0; s = (s + 1) & mask) {
+      if (hist->colors[i - 1] == key) {
+         hist->counts[i - 1] += count;
+         return(i - 1);
+      }
+   }
+   // New color, make room first
+   if (hist->size == hist->cap) {
+      hist->cap = hist->cap ? 2 * hist->cap : 256;
+      if (!(p = realloc(hist->colors, hist->cap * sizeof(uint32_t)))) {
+         return(-1);
+      }
+      hist->colors = p;
+      if (!(p = realloc(hist->counts, hist->cap * sizeof(uint32_t)))) {
+         return(-1);
+      }
+      hist->counts = p;
+   }
+   hist->colors[hist->size] = key;
+   hist->counts[hist->size] = count;
+   hist->slots[s] = ++hist->size;
+   if (2 * hist->size > (1 << hist->bits) && growSlots(hist) < 0) {
+      return(-1);
+   }
+   return(hist->size - 1);
+}
+
+/*---------------------------------------------------------------------------
+  This function counts the colors of an image.  Runs of equal pixels, very
+  common in GIF material, only cost one compare each.
+
+   Where:   ge_Histogram *hist   - histogram to add to
+            pixel *image         - the pixels
+            int npix             - number of pixels
+            int limit            - stop once more than limit colors are
+                                   found, 0 for no limit
+
+   Returns: number of distinct colors, or -1 if the limit was exceeded or
+            out of memory
+---------------------------------------------------------------------------*/
+int ge_hist_add(ge_Histogram *hist, const pixel *image, int npix, int limit) {
+   uint32_t key, run;
+   int i, j;
+
+   for (i = 0; i < npix; i = j) {
+      key = PIX_KEY(image[i]);
+      for (j = i + 1; j < npix && PIX_KEY(image[j]) == key; j++)
+         ;
+      run = j - i;
+      if (ge_hist_insert(hist, key, run) < 0) {
+         return(-1);
+      }
+      if (limit && hist->size > limit) {
+         return(-1);
+      }
+   }
+   return(hist->size);
+}
+
+/*---------------------------------------------------------------------------
+  This function looks up a color.
+
+   Returns: index of the color in hist->colors or -1 if it was never added
+---------------------------------------------------------------------------*/
+int ge_hist_find(const ge_Histogram *hist, pixel pix) {
+   uint32_t key = PIX_KEY(pix);
+   uint32_t mask = (1u << hist->bits) - 1;
+   uint32_t s;
+   int32_t i;
+
+   for (s = hashKey(key, hist->bits); (i = hist->slots[s]) != 0; s = (s + 1) & mask) {
+      if (hist->colors[i - 1] == key) {
+         return(i - 1);
+      }
+   }
+   return(-1);
+}
+
+
+/*---------------------------------------------------------------------------
+  This function adds the counts of one histogram to another.  Colors new to
+  dst are appended in src order, so merging the histograms of consecutive
+  row bands in order gives the same histogram as one pass over the image.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_hist_merge(ge_Histogram *dst, const ge_Histogram *src) {
+   int i;
+
+   for (i = 0; i < src->size; i++) {
+      if (ge_hist_insert(dst, src->colors[i], src->counts[i]) < 0) {
+         return(-1);
+      }
+   }
+   return(0);
+}
+
+
+/*---------------------------------------------------------------------------
+  Median cut.  Every histogram color becomes a point with integer
+  coordinates in the working color space and a weight (its pixel count).
+  The box with the largest squared error is split across its widest axis
+  until there are enough boxes; each box becomes the weighted mean of its
+  colors.
+---------------------------------------------------------------------------*/
+typedef struct {
+   int32_t c[3];        // coordinates in the working space
+   uint32_t count;      // pixels with this color
+   int entry;           // histogram entry
+} QPoint;
+
+typedef struct {
+   int start, n;        // points[start .. start+n-1]
+   int axis;            // axis with the largest variance
+   double sse;          // weighted squared error around the mean
+   double mean[3];
+} QBox;
+
+/*---------------------------------------------------------------------------
+  OKLab.  sRGB values go through a 256 entry linearization table, then the
+  OKLab matrices and cube roots.  Coordinates are integers: L in
+  0..GE_OKLAB_SCALE, a and b roughly within +-0.4 of that.
+---------------------------------------------------------------------------*/
+static float srgbLinear[256];
+
+static void oklabTableInit(void) {
+   double v;
+   int i;
+
+   for (i = 0; i < 256; i++) {
+      v = i / 255.0;
+      srgbLinear[i] = (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+   }
+}
+
+static void oklabTable(void) {
+#ifndef _WIN32
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, oklabTableInit);
+#else
+   static int done = 0;
+   if (!done) {
+      oklabTableInit();
+      done = 1;
+   }
+#endif
+}
+
+static void oklabFromRgb(int r, int g, int b, int32_t *lab) {
+   float lr = srgbLinear[r], lg = srgbLinear[g], lb = srgbLinear[b];
+   float l = cbrtf(0.4122214708f * lr + 0.5363325363f * lg + 0.0514459929f * lb);
+   float m = cbrtf(0.2119034982f * lr + 0.6806995451f * lg + 0.1073969566f * lb);
+   float s = cbrtf(0.0883024619f * lr + 0.2817188376f * lg + 0.6299787005f * lb);
+
+   lab[0] = (int32_t)lrintf(GE_OKLAB_SCALE * (0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s));
+   lab[1] = (int32_t)lrintf(GE_OKLAB_SCALE * (1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s));
+   lab[2] = (int32_t)lrintf(GE_OKLAB_SCALE * (0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s));
+}
+
+static uint8_t srgbEncode(double v) {
+   v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1 / 2.4) - 0.055;
+   return(v <= 0 ? 0 : v >= 1 ? 255 : (uint8_t)(v * 255 + .5));
+}
+
+static pixel rgbFromOklab(const double *lab) {
+   double L = lab[0] / GE_OKLAB_SCALE, a = lab[1] / GE_OKLAB_SCALE, b = lab[2] / GE_OKLAB_SCALE;
+   double l = L + 0.3963377774 * a + 0.2158037573 * b;
+   double m = L - 0.1055613458 * a - 0.0638541728 * b;
+   double s = L - 0.0894841775 * a - 1.2914855480 * b;
+   pixel pix;
+
+   l = l * l * l;
+   m = m * m * m;
+   s = s * s * s;
+   pix.r = srgbEncode(4.0767416621 * l - 3.3077115913 * m + 0.2309699292 * s);
+   pix.g = srgbEncode(-1.2684380046 * l + 2.6097574011 * m - 0.3413193965 * s);
+   pix.b = srgbEncode(-0.0041960863 * l - 0.7034186147 * m + 1.7076147010 * s);
+   return(pix);
+}
+
+/*---------------------------------------------------------------------------
+  This function converts RGB pixels to integer OKLab coordinates.
+
+   Where:   pixel *rgb           - the pixels
+            int32_t *lab         - receives 3 coordinates per pixel
+            int npix             - number of pixels
+---------------------------------------------------------------------------*/
+void ge_rgb_to_oklab(const pixel *rgb, int32_t *lab, int npix) {
+   int i;
+
+   oklabTable();
+   for (i = 0; i < npix; i++) {
+      oklabFromRgb(rgb[i].r, rgb[i].g, rgb[i].b, &lab[3 * i]);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function converts a histogram key to working space coordinates.
+  HSV keys are packed hsvPixel values; the 9th hue bit is unpacked so hue
+  is a plain 0..360 axis.  OKLab keys are RGB colors.
+---------------------------------------------------------------------------*/
+static void keyToCoords(uint32_t key, int space, int32_t *c) {
+   c[0] = (key >> 16) & 0xff;
+   c[1] = (key >> 8) & 0xff;
+   c[2] = key & 0xff;
+   if (space == GE_SPACE_OKLAB) {
+      oklabFromRgb(c[0], c[1], c[2], c);
+   }
+   if (space == GE_SPACE_HSV && (c[1] & S_MASK_HIGH)) {
+      c[0] += 255;
+      c[1] &= S_MASK_LOW;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function converts working space coordinates back to a palette entry.
+---------------------------------------------------------------------------*/
+static pixel coordsToPixel(const double *c, int space) {
+   int v[3], i;
+   pixel pix;
+
+   if (space == GE_SPACE_OKLAB) {
+      return(rgbFromOklab(c));
+   }
+   for (i = 0; i < 3; i++) {
+      v[i] = (int)(c[i] + .5);
+   }
+   if (space == GE_SPACE_HSV && v[0] > 255) {
+      v[0] -= 255;
+      v[1] |= S_MASK_HIGH;
+   }
+   pix.r = v[0];
+   pix.g = v[1];
+   pix.b = v[2];
+   return(pix);
+}
+
+/*---------------------------------------------------------------------------
+  This function computes the mean, squared error and widest axis of a box.
+---------------------------------------------------------------------------*/
+static void boxStats(QBox *box, const QPoint *pts) {
+   double sum[3] = {0, 0, 0}, sq[3] = {0, 0, 0}, wt = 0, var, best = -1;
+   const QPoint *p;
+   int i, a;
+
+   for (i = 0; i < box->n; i++) {
+      p = &pts[box->start + i];
+      for (a = 0; a < 3; a++) {
+         sum[a] += (double)p->count * p->c[a];
+         sq[a] += (double)p->count * p->c[a] * p->c[a];
+      }
+      wt += p->count;
+   }
+   box->sse = 0;
+   for (a = 0; a < 3; a++) {
+      box->mean[a] = sum[a] / wt;
+      var = sq[a] - sum[a] * box->mean[a];
+      box->sse += var;
+      if (var > best) {
+         best = var;
+         box->axis = a;
+      }
+   }
+   if (box->n < 2) {
+      box->sse = 0;   // cannot be split
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function sorts points along one axis (quicksort, insertion sort for
+  short runs).
+---------------------------------------------------------------------------*/
+static void sortPoints(QPoint *pts, int n, int axis) {
+   QPoint t;
+   int32_t pivot;
+   int i, j;
+
+   while (n > 16) {
+      pivot = pts[n / 2].c[axis];
+      for (i = 0, j = n - 1; ; i++, j--) {
+         while (pts[i].c[axis] < pivot) i++;
+         while (pts[j].c[axis] > pivot) j--;
+         if (i >= j) break;
+         t = pts[i]; pts[i] = pts[j]; pts[j] = t;
+      }
+      // Recurse into the smaller half, loop on the larger one
+      if (j + 1 < n - j - 1) {
+         sortPoints(pts, j + 1, axis);
+         pts += j + 1;
+         n -= j + 1;
+      }
+      else {
+         sortPoints(pts + j + 1, n - j - 1, axis);
+         n = j + 1;
+      }
+   }
+   for (i = 1; i < n; i++) {
+      t = pts[i];
+      for (j = i; j > 0 && pts[j - 1].c[axis] > t.c[axis]; j--) {
+         pts[j] = pts[j - 1];
+      }
+      pts[j] = t;
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function splits a box along its widest axis.  The cut is placed
+  where it removes the most squared error, which for skewed boxes is
+  between the median and the mean.
+
+   Returns: 0 on success, -1 if the box holds a single color
+---------------------------------------------------------------------------*/
+static int splitBox(QBox *box, QBox *other, QPoint *pts) {
+   QPoint *p = &pts[box->start];
+   double wt = 0, sum = 0, w1 = 0, s1 = 0, score, best = -1;
+   int i, cut = 0, a = box->axis;
+
+   if (box->n < 2) {
+      return(-1);
+   }
+   sortPoints(p, box->n, a);
+   for (i = 0; i < box->n; i++) {
+      wt += p[i].count;
+      sum += (double)p[i].count * p[i].c[a];
+   }
+   // Maximize the variance between the two halves
+   for (i = 0; i < box->n - 1; i++) {
+      w1 += p[i].count;
+      s1 += (double)p[i].count * p[i].c[a];
+      if (p[i].c[a] == p[i + 1].c[a]) {
+         continue;
+      }
+      score = s1 * s1 / w1 + (sum - s1) * (sum - s1) / (wt - w1);
+      if (score > best) {
+         best = score;
+         cut = i + 1;
+      }
+   }
+   if (cut == 0) {
+      cut = box->n / 2;   // all equal on this axis
+   }
+   other->start = box->start + cut;
+   other->n = box->n - cut;
+   box->n = cut;
+   boxStats(box, pts);
+   boxStats(other, pts);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function reduces a histogram to a palette.  If the histogram has no
+  more colors than palLen they are used as they are; otherwise median cut
+  produces exactly palLen colors.
+
+   Where:   ge_Histogram *hist   - the image's colors
+            int palLen           - maximum palette size, 1..MAX_PALETTE
+            int space            - GE_SPACE_*: space of the histogram keys;
+                                   GE_SPACE_OKLAB keys are RGB, split and
+                                   averaged in OKLab
+            pixel *palette       - receives the palette, in the key space
+            uint8_t *map         - receives the palette index of every
+                                   histogram entry (hist->size entries),
+                                   may be NULL
+
+   Returns: number of palette entries, or -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_quantize(const ge_Histogram *hist, int palLen, int space, pixel *palette,
+                uint8_t *map) {
+   QPoint *pts;
+   QBox boxes[MAX_PALETTE];
+   int nboxes, i, j, best;
+
+   if (palLen > MAX_PALETTE) {
+      palLen = MAX_PALETTE;
+   }
+   if (hist->size <= palLen) {
+      for (i = 0; i < hist->size; i++) {
+         palette[i].r = hist->colors[i] >> 16;
+         palette[i].g = hist->colors[i] >> 8;
+         palette[i].b = hist->colors[i];
+         if (map) {
+            map[i] = i;
+         }
+      }
+      return(hist->size);
+   }
+
+   pts = malloc(hist->size * sizeof(QPoint));
+   if (!pts) {
+      return(-1);
+   }
+   oklabTable();
+   for (i = 0; i < hist->size; i++) {
+      keyToCoords(hist->colors[i], space, pts[i].c);
+      pts[i].count = hist->counts[i];
+      pts[i].entry = i;
+   }
+   boxes[0].start = 0;
+   boxes[0].n = hist->size;
+   boxStats(&boxes[0], pts);
+   for (nboxes = 1; nboxes < palLen; nboxes++) {
+      best = 0;
+      for (i = 1; i < nboxes; i++) {
+         if (boxes[i].sse > boxes[best].sse) {
+            best = i;
+         }
+      }
+      if (splitBox(&boxes[best], &boxes[nboxes], pts) < 0) {
+         break;
+      }
+   }
+   for (i = 0; i < nboxes; i++) {
+      palette[i] = coordsToPixel(boxes[i].mean, space);
+      for (j = 0; map && j < boxes[i].n; j++) {
+         map[pts[boxes[i].start + j].entry] = i;
+      }
+   }
+   free(pts);
+   return(nboxes);
+}
+
+
+/*---------------------------------------------------------------------------
+  This function allocates an empty inverse colormap.
+
+   Returns: the map or NULL if out of memory
+---------------------------------------------------------------------------*/
+ge_InvMap *ge_invmap_new(void) {
+   return(calloc(1, sizeof(ge_InvMap)));
+}
+
+/*---------------------------------------------------------------------------
+  This function frees an inverse colormap.
+---------------------------------------------------------------------------*/
+void ge_invmap_free(ge_InvMap *inv) {
+   free(inv);
+}
+
+/*---------------------------------------------------------------------------
+  k-d tree over palette colors for nearest color search.  Each node splits
+  its colors at the median of the axis with the largest spread.
+---------------------------------------------------------------------------*/
+typedef struct {
+   int32_t c[3];
+   int16_t left, right;    // children, -1 for none
+   uint8_t axis, index;    // split axis, palette index
+} KdNode;
+
+typedef struct {
+   KdNode nodes[MAX_PALETTE];
+   int n;
+} KdTree;
+
+static int kdBuild(KdTree *tree, const int32_t (*pts)[3], uint8_t *idx, int n) {
+   int32_t lo, hi, best = -1;
+   int a, i, j, mid, node;
+   uint8_t t;
+   KdNode *nd;
+
+   if (n <= 0) {
+      return(-1);
+   }
+   nd = &tree->nodes[node = tree->n++];
+   nd->axis = 0;
+   for (a = 0; a < 3; a++) {
+      lo = hi = pts[idx[0]][a];
+      for (i = 1; i < n; i++) {
+         lo = MIN(lo, pts[idx[i]][a]);
+         hi = MAX(hi, pts[idx[i]][a]);
+      }
+      if (hi - lo > best) {
+         best = hi - lo;
+         nd->axis = a;
+      }
+   }
+   // Insertion sort along the axis, at most 256 colors
+   for (i = 1; i < n; i++) {
+      t = idx[i];
+      for (j = i; j > 0 && pts[idx[j - 1]][nd->axis] > pts[t][nd->axis]; j--) {
+         idx[j] = idx[j - 1];
+      }
+      idx[j] = t;
+   }
+   mid = n / 2;
+   nd->index = idx[mid];
+   memcpy(nd->c, pts[idx[mid]], sizeof(nd->c));
+   nd->left = kdBuild(tree, pts, idx, mid);
+   tree->nodes[node].right = kdBuild(tree, pts, idx + mid + 1, n - mid - 1);
+   return(node);
+}
+
+static void kdNearest(const KdTree *tree, int node, const int32_t *q, int *best,
+                      int64_t *bestDist) {
+   const KdNode *nd;
+   int64_t d, diff;
+   int a;
+
+   while (node >= 0) {
+      nd = &tree->nodes[node];
+      d = 0;
+      for (a = 0; a < 3; a++) {
+         d += (int64_t)(q[a] - nd->c[a]) * (q[a] - nd->c[a]);
+      }
+      if (d < *bestDist || (d == *bestDist && nd->index < *best)) {
+         *bestDist = d;
+         *best = nd->index;
+      }
+      diff = q[nd->axis] - nd->c[nd->axis];
+      // Near side first, far side only if the splitting plane is close
+      if (diff < 0) {
+         kdNearest(tree, nd->left, q, best, bestDist);
+         if (diff * diff > *bestDist) {
+            return;
+         }
+         node = nd->right;
+      }
+      else {
+         kdNearest(tree, nd->right, q, best, bestDist);
+         if (diff * diff > *bestDist) {
+            return;
+         }
+         node = nd->left;
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function fills an inverse colormap by searching a k-d tree of the
+  palette from every cell center.  Cells are visited in order, and the
+  previous cell's answer seeds each search, so most of the tree is pruned.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int invmapKd(ge_InvMap *inv, const pixel *palette, int ncolors, int space) {
+   int32_t (*pts)[3], q[3];
+   KdTree *tree;
+   uint8_t idx[MAX_PALETTE];
+   int64_t bestDist;
+   int i, a, r, g, b, best = 0, cell = 0;
+   pixel center;
+
+   tree = malloc(sizeof(KdTree));
+   pts = malloc(ncolors * sizeof(*pts));
+   if (!tree || !pts) {
+      free(tree);
+      free(pts);
+      return(-1);
+   }
+   for (i = 0; i < ncolors; i++) {
+      if (space == GE_SPACE_OKLAB) {
+         ge_rgb_to_oklab(&palette[i], pts[i], 1);
+      }
+      else {
+         pts[i][0] = palette[i].r;
+         pts[i][1] = palette[i].g;
+         pts[i][2] = palette[i].b;
+      }
+      idx[i] = i;
+   }
+   tree->n = 0;
+   kdBuild(tree, (const int32_t (*)[3])pts, idx, ncolors);
+   for (r = 0; r < 32; r++) {
+      for (g = 0; g < 64; g++) {
+         for (b = 0; b < 32; b++, cell++) {
+            center.r = 8 * r + 4;
+            center.g = 4 * g + 2;
+            center.b = 8 * b + 4;
+            if (space == GE_SPACE_OKLAB) {
+               ge_rgb_to_oklab(&center, q, 1);
+            }
+            else {
+               q[0] = center.r;
+               q[1] = center.g;
+               q[2] = center.b;
+            }
+            bestDist = 0;
+            for (a = 0; a < 3; a++) {
+               bestDist += (int64_t)(q[a] - pts[best][a]) * (q[a] - pts[best][a]);
+            }
+            kdNearest(tree, 0, q, &best, &bestDist);
+            inv->table[cell] = best;
+         }
+      }
+   }
+   free(tree);
+   free(pts);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function fills an RGB inverse colormap by brute force.  Distances
+  are kept per cell and lowered one palette color at a time, with the
+  squared terms of each axis computed once per color, so the build is a
+  tight add and compare loop.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int invmapRgb(ge_InvMap *inv, const pixel *palette, int ncolors) {
+   int32_t *dist, dr, drg, rsq[32], gsq[64], bsq[32];
+   int k, r, g, b, i;
+
+   dist = malloc(sizeof(inv->table) * sizeof(int32_t));
+   if (!dist) {
+      return(-1);
+   }
+   for (i = 0; i < (int)sizeof(inv->table); i++) {
+      dist[i] = INT32_MAX;
+   }
+   for (k = 0; k < ncolors; k++) {
+      // Doubled coordinates so cell centers are integers
+      for (i = 0; i < 32; i++) {
+         rsq[i] = (16 * i + 7 - 2 * palette[k].r) * (16 * i + 7 - 2 * palette[k].r);
+         bsq[i] = (16 * i + 7 - 2 * palette[k].b) * (16 * i + 7 - 2 * palette[k].b);
+      }
+      for (i = 0; i < 64; i++) {
+         gsq[i] = (8 * i + 3 - 2 * palette[k].g) * (8 * i + 3 - 2 * palette[k].g);
+      }
+      i = 0;
+      for (r = 0; r < 32; r++) {
+         dr = rsq[r];
+         for (g = 0; g < 64; g++) {
+            drg = dr + gsq[g];
+            for (b = 0; b < 32; b++, i++) {
+               if (drg + bsq[b] < dist[i]) {
+                  dist[i] = drg + bsq[b];
+                  inv->table[i] = k;
+               }
+            }
+         }
+      }
+   }
+   free(dist);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  These functions make an inverse colormap match a palette.  Every cell
+  gets the palette entry nearest to its center, by RGB distance or, with
+  GE_SPACE_OKLAB, by OKLab distance.  Nothing is done if the map already
+  holds this palette in this space.
+
+   Where:   ge_InvMap *inv       - the map to update
+            pixel *palette       - the palette
+            int ncolors          - palette entries, 1..MAX_PALETTE
+            int space            - GE_SPACE_RGB or GE_SPACE_OKLAB
+
+   Returns: 1 if the table was rebuilt, 0 if it was reused, -1 if out of
+            memory
+---------------------------------------------------------------------------*/
+int ge_invmap_set_space(ge_InvMap *inv, const pixel *palette, int ncolors, int space) {
+   int ret;
+
+   space = space == GE_SPACE_OKLAB ? GE_SPACE_OKLAB : GE_SPACE_RGB;
+   if (inv->ncolors == ncolors && inv->space == space &&
+       !memcmp(inv->palette, palette, ncolors * 3)) {
+      return(0);
+   }
+   if (space == GE_SPACE_OKLAB) {
+      ret = invmapKd(inv, palette, ncolors, space);
+   }
+   else {
+      ret = invmapRgb(inv, palette, ncolors);
+   }
+   if (ret < 0) {
+      inv->ncolors = 0;
+      return(-1);
+   }
+   memcpy(inv->palette, palette, ncolors * 3);
+   inv->ncolors = ncolors;
+   inv->space = space;
+   return(1);
+}
+
+int ge_invmap_set(ge_InvMap *inv, const pixel *palette, int ncolors) {
+   return(ge_invmap_set_space(inv, palette, ncolors, GE_SPACE_RGB));
+}
+
+/*---------------------------------------------------------------------------
+  This function maps true color pixels to palette indexes.
+
+   Where:   ge_InvMap *inv       - map built by ge_invmap_set()
+            pixel *image         - the pixels
+            uint8_t *index       - receives one index per pixel
+            int npix             - number of pixels
+---------------------------------------------------------------------------*/
+void ge_invmap_apply(const ge_InvMap *inv, const pixel *image, uint8_t *index, int npix) {
+   int i;
+
+   for (i = 0; i < npix; i++) {
+      index[i] = inv->table[GE_INV_INDEX(image[i])];
+   }
+}
+
+
+#ifndef _WIN32
+/* Shared state of one ge_run_tasks() call. */
+typedef struct {
+   pthread_mutex_t lock;
+   ge_Task task;
+   void *arg;
+   int next, ntasks;
+} TaskQueue;
+
+/*---------------------------------------------------------------------------
+  This function is one worker: it takes task indexes until none are left.
+---------------------------------------------------------------------------*/
+static void *taskWorker(void *p) {
+   TaskQueue *q = p;
+   int i;
+
+   for (;;) {
+      pthread_mutex_lock(&q->lock);
+      i = q->next++;
+      pthread_mutex_unlock(&q->lock);
+      if (i >= q->ntasks) {
+         break;
+      }
+      q->task(q->arg, i);
+   }
+   return(NULL);
+}
+#endif
+
+/*---------------------------------------------------------------------------
+  This function runs task(arg, i) for i in 0..ntasks-1 and returns when all
+  are done.  An external pool in opt is used if given; otherwise up to
+  opt->threads threads are started for the call, the caller being one of
+  them.  Without options, or if threads cannot be started, the tasks run
+  in order on the calling thread.
+
+   Where:   ge_QuantOpts *opt    - threads or pool to use, may be NULL
+            ge_Task task         - the work
+            void *arg            - passed to every task
+            int ntasks           - number of tasks
+---------------------------------------------------------------------------*/
+void ge_run_tasks(const ge_QuantOpts *opt, ge_Task task, void *arg, int ntasks) {
+   int i;
+
+   if (opt && opt->pool_run && ntasks > 1) {
+      opt->pool_run(opt->pool, task, arg, ntasks);
+      return;
+   }
+#ifndef _WIN32
+   if (opt && opt->threads > 1 && ntasks > 1) {
+      pthread_t tid[GE_MAX_THREADS];
+      TaskQueue q;
+      int n = MIN(MIN(opt->threads, ntasks), GE_MAX_THREADS);
+
+      pthread_mutex_init(&q.lock, NULL);
+      q.task = task;
+      q.arg = arg;
+      q.next = 0;
+      q.ntasks = ntasks;
+      for (i = 1; i < n; i++) {
+         if (pthread_create(&tid[i], NULL, taskWorker, &q) != 0) {
+            break;
+         }
+      }
+      n = i;
+      taskWorker(&q);
+      for (i = 1; i < n; i++) {
+         pthread_join(tid[i], NULL);
+      }
+      pthread_mutex_destroy(&q.lock);
+      return;
+   }
+#endif
+   for (i = 0; i < ntasks; i++) {
+      task(arg, i);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+  Dithering.  Both methods look up the adjusted pixel in an inverse
+  colormap.  The dither strength follows the mean distance between palette
+  colors, taken as a uniform grid of ncolors entries.
+---------------------------------------------------------------------------*/
+#define FS_CHUNK  (32)    // pixels done between progress updates
+
+static const uint8_t bayer8[8][8] = {
+   { 0, 32,  8, 40,  2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26},
+   {12, 44,  4, 36, 14, 46,  6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+   { 3, 35, 11, 43,  1, 33,  9, 41}, {51, 19, 59, 27, 49, 17, 57, 25},
+   {15, 47,  7, 39, 13, 45,  5, 37}, {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static uint8_t clamp255(int v) {
+   return(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+/*---------------------------------------------------------------------------
+  This function reads one row of a source frame as pixels.  Packed RGB rows
+  are returned in place; other formats are converted into row.  With clear,
+  clear[x] is set for pixels whose alpha is below src->alpha_min.
+
+   Where:   ge_Source *src       - the frame
+            int w                - frame width
+            int y                - the row
+            pixel *row           - room for w pixels, unused for GE_FMT_RGB
+            uint8_t *clear       - receives w transparency flags, may be NULL
+
+   Returns: the pixels of the row
+---------------------------------------------------------------------------*/
+const pixel *ge_source_row(const ge_Source *src, int w, int y, pixel *row, uint8_t *clear) {
+   const uint8_t *in, *u, *v, *planes[3];
+   int x, r, c, d, e;
+
+   switch (src->format) {
+   case GE_FMT_RGBA:
+   case GE_FMT_BGRA:
+      in = src->plane[0] + (size_t)y * (src->stride[0] ? src->stride[0] : 4 * w);
+      r = src->format == GE_FMT_RGBA ? 0 : 2;
+      for (x = 0; x < w; x++) {
+         row[x].r = in[4 * x + r];
+         row[x].g = in[4 * x + 1];
+         row[x].b = in[4 * x + 2 - r];
+      }
+      if (clear) {
+         for (x = 0; x < w; x++) {
+            clear[x] = in[4 * x + 3] < src->alpha_min;
+         }
+      }
+      return(row);
+
+   case GE_FMT_I420:
+      in = src->plane[0] + (size_t)y * (src->stride[0] ? src->stride[0] : w);
+      u = src->plane[1] + (size_t)(y / 2) * (src->stride[1] ? src->stride[1] : (w + 1) / 2);
+      v = src->plane[2] + (size_t)(y / 2) * (src->stride[2] ? src->stride[2] : (w + 1) / 2);
+      for (x = 0; x < w; x++) {
+         // BT.601 video range, 8 bit fixed point
+         c = 298 * (in[x] - 16) + 128;
+         d = u[x / 2] - 128;
+         e = v[x / 2] - 128;
+         row[x].r = clamp255((c + 409 * e) >> 8);
+         row[x].g = clamp255((c - 100 * d - 208 * e) >> 8);
+         row[x].b = clamp255((c + 516 * d) >> 8);
+      }
+      break;
+
+   case GE_FMT_PLANAR:
+      ge_planar_rows(src, w, y, planes);
+      ge_planar_pack(planes[0], planes[1], planes[2], w, row);
+      break;
+
+   default:
+      in = src->plane[0] + (size_t)y * (src->stride[0] ? src->stride[0] : 3 * w);
+      if (clear) {
+         memset(clear, 0, w);
+      }
+      return((const pixel *)in);
+   }
+   if (clear) {
+      memset(clear, 0, w);
+   }
+   return(row);
+}
+
+/*---------------------------------------------------------------------------
+  These functions map rows of an image with an 8x8 ordered (Bayer) dither.
+  Rows are independent, so bands of rows can be done in parallel.  The
+  source version reads any ge_Source format and gives transparent pixels
+  tindex.
+
+   Where:   ge_InvMap *inv       - map built by ge_invmap_set()
+            pixel *image         - the whole image
+            ge_Source *src       - or the whole source frame
+            uint8_t *index       - the whole index image
+            int w                - image width
+            int y0, y1           - rows y0..y1-1 are mapped
+            int tindex           - transparent index, -1 for none
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_dither_ordered_src(const ge_InvMap *inv, const ge_Source *src, uint8_t *index,
+                          int w, int y0, int y1, int tindex) {
+   int spread = (int)(192.0 / cbrt(inv->ncolors));
+   int off[8][8], x, y, d;
+   const uint8_t *planes[3];
+   const pixel *in;
+   pixel pix, *row = NULL;
+   uint8_t *out, *clear = NULL;
+
+   if (src->format != GE_FMT_RGB && !(row = malloc(w * sizeof(pixel)))) {
+      return(-1);
+   }
+   if (tindex >= 0 && !(clear = malloc(w))) {
+      free(row);
+      return(-1);
+   }
+   for (y = 0; y < 8; y++) {
+      for (x = 0; x < 8; x++) {
+         off[y][x] = (2 * bayer8[y][x] + 1 - 64) * spread / 128;
+      }
+   }
+   for (y = y0; y < y1; y++) {
+      out = &index[(long)y * w];
+      if (src->format == GE_FMT_PLANAR) {
+         // No alpha, the planes are dithered without packing them
+         ge_planar_rows(src, w, y, planes);
+         ge_dither_row_planar(inv, planes[0], planes[1], planes[2], off[y & 7], out, w);
+         continue;
+      }
+      in = ge_source_row(src, w, y, row, clear);
+      for (x = 0; x < w; x++) {
+         d = off[y & 7][x & 7];
+         pix.r = clamp255(in[x].r + d);
+         pix.g = clamp255(in[x].g + d);
+         pix.b = clamp255(in[x].b + d);
+         out[x] = inv->table[GE_INV_INDEX(pix)];
+      }
+      for (x = 0; clear && x < w; x++) {
+         if (clear[x]) {
+            out[x] = tindex;
+         }
+      }
+   }
+   free(row);
+   free(clear);
+   return(0);
+}
+
+void ge_dither_ordered(const ge_InvMap *inv, const pixel *image, uint8_t *index,
+                       int w, int y0, int y1) {
+   ge_Source src = {.format = GE_FMT_RGB, .plane = {(const uint8_t *)image}};
+
+   ge_dither_ordered_src(inv, &src, index, w, y0, y1, -1);
+}
+
+/* Shared state of one Floyd-Steinberg pass. */
+typedef struct {
+   const ge_InvMap *inv;
+   const ge_Source *src;
+   uint8_t *index;
+   int w, h, nrows;
+   int tindex;          // transparent index, -1 for none
+   pixel *rows;         // one converted row per worker, NULL for packed RGB
+   uint8_t *clear;      // one row of transparency flags per worker
+   int16_t *err;        // nrows rows of w + 2 errors (x16) per channel
+   int *done;           // pixels finished in each row
+   int next;            // next row to take
+} FSJob;
+
+/*---------------------------------------------------------------------------
+  This task is one Floyd-Steinberg worker.  Rows are taken in order; a row
+  only works on pixels whose error from the row above is complete, so rows
+  run as a pipeline a few pixels behind each other.  Error rows are kept in
+  a ring longer than the number of rows in flight.
+---------------------------------------------------------------------------*/
+static void fsWorker(void *arg, int worker) {
+   FSJob *job = arg;
+   const pixel *in;
+   int16_t *cur, *below;
+   uint8_t *out, *clear = NULL;
+   int y, x, x1, c, k, v, e, carry[3], need;
+   pixel pix, *row = NULL;
+
+   if (job->rows) {
+      row = &job->rows[(long)worker * job->w];
+   }
+   if (job->clear) {
+      clear = &job->clear[(long)worker * job->w];
+   }
+   while ((y = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->h) {
+      in = ge_source_row(job->src, job->w, y, row, clear);
+      out = &job->index[(long)y * job->w];
+      cur = &job->err[(long)(y % job->nrows) * (job->w + 2) * 3];
+      below = &job->err[(long)((y + 1) % job->nrows) * (job->w + 2) * 3];
+      // The last row that used this ring slot is finished, make sure its
+      // accesses are ordered before the slot is cleared
+      k = y + 1 - job->nrows;
+      while (k >= 0 && __atomic_load_n(&job->done[k], __ATOMIC_ACQUIRE) < job->w) {
+#ifndef _WIN32
+         sched_yield();
+#endif
+      }
+      memset(below, 0, (job->w + 2) * 3 * sizeof(int16_t));
+      carry[0] = carry[1] = carry[2] = 0;
+      for (x = 0; x < job->w; x = x1) {
+         x1 = MIN(x + FS_CHUNK, job->w);
+         // The row above must be past x1 to have spread its errors here
+         need = MIN(x1 + 1, job->w);
+         while (y > 0 && __atomic_load_n(&job->done[y - 1], __ATOMIC_ACQUIRE) < need) {
+#ifndef _WIN32
+            sched_yield();
+#endif
+         }
+         for (; x < x1; x++) {
+            if (clear && clear[x]) {
+               // Transparent, there is no error to spread
+               out[x] = job->tindex;
+               carry[0] = carry[1] = carry[2] = 0;
+               continue;
+            }
+            for (c = 0; c < 3; c++) {
+               v = (&in[x].r)[c] + (cur[(x + 1) * 3 + c] + carry[c] + 8) / 16;
+               (&pix.r)[c] = clamp255(v);
+            }
+            k = job->inv->table[GE_INV_INDEX(pix)];
+            out[x] = k;
+            for (c = 0; c < 3; c++) {
+               v = (&in[x].r)[c] + (cur[(x + 1) * 3 + c] + carry[c] + 8) / 16;
+               e = v - job->inv->palette[k * 3 + c];
+               e = e < -255 ? -255 : e > 255 ? 255 : e;
+               carry[c] = 7 * e;
+               below[x * 3 + c] += 3 * e;
+               below[(x + 1) * 3 + c] += 5 * e;
+               below[(x + 2) * 3 + c] += e;
+            }
+         }
+         __atomic_store_n(&job->done[y], x1, __ATOMIC_RELEASE);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+  These functions map an image with Floyd-Steinberg error diffusion.  With
+  several threads rows are processed as a pipeline, each row following the
+  one above it.  The result does not depend on the number of threads.  The
+  source version reads any ge_Source format; transparent pixels take tindex
+  and spread no error.
+
+   Where:   ge_InvMap *inv       - map built by ge_invmap_set()
+            pixel *image         - the image
+            ge_Source *src       - or the source frame
+            uint8_t *index       - receives the index image
+            int w, h             - image size
+            int tindex           - transparent index, -1 for none
+            ge_QuantOpts *opt    - threads or pool to use, may be NULL
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+int ge_dither_fs_src(const ge_InvMap *inv, const ge_Source *src, uint8_t *index,
+                     int w, int h, int tindex, const ge_QuantOpts *opt) {
+   FSJob job;
+   int nworkers = 1, ret = -1;
+
+   if (opt && (opt->threads > 1 || opt->pool_run)) {
+      nworkers = MIN(MAX(opt->threads, 2), GE_MAX_THREADS);
+   }
+   memset(&job, 0, sizeof(job));
+   job.inv = inv;
+   job.src = src;
+   job.index = index;
+   job.w = w;
+   job.h = h;
+   job.tindex = tindex;
+   job.nrows = nworkers + 2;
+   job.err = calloc((size_t)job.nrows * (w + 2) * 3, sizeof(int16_t));
+   job.done = calloc(h, sizeof(int));
+   if (!job.err || !job.done) {
+      goto done;
+   }
+   if (src->format != GE_FMT_RGB &&
+       !(job.rows = malloc((size_t)nworkers * w * sizeof(pixel)))) {
+      goto done;
+   }
+   if (tindex >= 0 && !(job.clear = malloc((size_t)nworkers * w))) {
+      goto done;
+   }
+   ge_run_tasks(opt, fsWorker, &job, nworkers);
+   ret = 0;
+
+done:
+   free(job.err);
+   free(job.done);
+   free(job.rows);
+   free(job.clear);
+   return(ret);
+}
+
+int ge_dither_fs(const ge_InvMap *inv, const pixel *image, uint8_t *index,
+                 int w, int h, const ge_QuantOpts *opt) {
+   ge_Source src = {.format = GE_FMT_RGB, .plane = {(const uint8_t *)image}};
+
+   return(ge_dither_fs_src(inv, &src, index, w, h, -1, opt));
+}
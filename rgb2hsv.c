@@ -9,6 +9,14 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GE_X86_SIMD
+#include <immintrin.h>
+#endif
 #include "gifEncDec.h"
 
 double max(double a, double b, double c) {
@@ -150,6 +158,240 @@ pixel HSVtoRGB(hsvPixel hsv){
     return(pix);
 }
 
+/*---------------------------------------------------------------------------
+  Batch conversion with integer arithmetic and tables.  V only depends on
+  the largest channel and S on the largest and smallest, so both come from
+  tables filled with the scalar formulas.  The hue is
+
+     h = base + 60 * n / d
+
+  with d = max - min and n the difference of the other two channels, so
+  its rounding comes from a table of round(60 * n / d).  When 60 * n / d is
+  exactly halfway between two integers, or h is exactly 255, the scalar
+  doubles may round either way; those few pixels are done by RGBtoHSV().
+  The results are therefore always the same as RGBtoHSV().
+---------------------------------------------------------------------------*/
+#define HUE_TIE   (127)    // hueRound[] marker: use the scalar version
+
+static uint8_t valueTab[256 + 4];         // +4: room for 32 bit gathers
+static uint8_t satTab[256 * 256 + 4];     // [max][min]
+static int8_t hueRound[511 * 256 + 4];    // [n + 255][d]
+
+static void hsvTablesInit(void) {
+   pixel pix;
+   int n, d, mx, mn;
+
+   for (mx = 0; mx < 256; mx++) {
+      pix.r = mx;
+      pix.g = pix.b = 0;
+      valueTab[mx] = RGBtoHSV(pix).v;
+      for (mn = 0; mn <= mx; mn++) {
+         pix.g = pix.b = mn;
+         satTab[mx * 256 + mn] = RGBtoHSV(pix).s & S_MASK_LOW;
+      }
+   }
+   for (n = -255; n <= 255; n++) {
+      hueRound[(n + 255) * 256] = 0;   // d == 0: grey, hue 0
+      for (d = 1; d < 256; d++) {
+         if ((120 * n + d) % (2 * d) == 0) {
+            hueRound[(n + 255) * 256 + d] = HUE_TIE;
+         }
+         else {
+            // floor((120n + d) / 2d) for either sign
+            hueRound[(n + 255) * 256 + d] = (120 * n + d + 2 * d * 60) / (2 * d) - 60;
+         }
+      }
+   }
+}
+
+static void hsvTables(void) {
+#ifndef _WIN32
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, hsvTablesInit);
+#else
+   static int done = 0;
+   if (!done) {
+      hsvTablesInit();
+      done = 1;
+   }
+#endif
+}
+
+/*---------------------------------------------------------------------------
+  This function converts one pixel with the tables.
+---------------------------------------------------------------------------*/
+static hsvPixel hsvFromTables(pixel pix) {
+   int r = pix.r, g = pix.g, b = pix.b;
+   int mx, mn, n, d, base, t, hnum;
+   hsvPixel hsv;
+
+   mx = r > g ? (r > b ? r : b) : (g > b ? g : b);
+   mn = r < g ? (r < b ? r : b) : (g < b ? g : b);
+   d = mx - mn;
+   if (mx == r) {
+      n = g - b;
+      base = n < 0 ? 360 : 0;
+   }
+   else if (mx == g) {
+      n = b - r;
+      base = 120;
+   }
+   else {
+      n = r - g;
+      base = 240;
+   }
+   t = hueRound[(n + 255) * 256 + d];
+   hnum = base * d + 60 * n;
+   if (t == HUE_TIE || (d && hnum == 255 * d)) {
+      return(RGBtoHSV(pix));
+   }
+   hsv.v = valueTab[mx];
+   hsv.s = satTab[mx * 256 + mn];
+   if (hnum > 255 * d) {
+      hsv.h = base + t - 255;
+      hsv.s |= S_MASK_HIGH;
+   }
+   else {
+      hsv.h = base + t;
+   }
+   return(hsv);
+}
+
+#ifdef GE_X86_SIMD
+/*---------------------------------------------------------------------------
+  This function converts 8 pixels per step with AVX2: the channels are read
+  with 32 bit gathers and the table lookups are gathers too.  It stops 8
+  pixels before the end so no gather reads past the buffer.
+
+   Returns: number of pixels converted
+---------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static int rgbToHsvAvx2(const pixel *rgb, hsvPixel *hsv, int npix) {
+   const __m256i lane3 = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+   const __m256i ff = _mm256_set1_epi32(0xFF), zero = _mm256_setzero_si256();
+   __m256i px, r, g, b, mx, mn, d, n, base, isR, isG, t, hnum, lim, flag, fall, h, s, v;
+   uint32_t out[8];
+   int i, k, m;
+
+   for (i = 0; i + 8 < npix; i += 8) {
+      px = _mm256_i32gather_epi32((const int *)&rgb[i], lane3, 1);
+      r = _mm256_and_si256(px, ff);
+      g = _mm256_and_si256(_mm256_srli_epi32(px, 8), ff);
+      b = _mm256_and_si256(_mm256_srli_epi32(px, 16), ff);
+      mx = _mm256_max_epi32(r, _mm256_max_epi32(g, b));
+      mn = _mm256_min_epi32(r, _mm256_min_epi32(g, b));
+      d = _mm256_sub_epi32(mx, mn);
+      isR = _mm256_cmpeq_epi32(mx, r);
+      isG = _mm256_andnot_si256(isR, _mm256_cmpeq_epi32(mx, g));
+      n = _mm256_blendv_epi8(_mm256_sub_epi32(r, g), _mm256_sub_epi32(b, r), isG);
+      n = _mm256_blendv_epi8(n, _mm256_sub_epi32(g, b), isR);
+      base = _mm256_blendv_epi8(_mm256_set1_epi32(240), _mm256_set1_epi32(120), isG);
+      base = _mm256_blendv_epi8(base, _mm256_and_si256(_mm256_cmpgt_epi32(zero, n),
+                                _mm256_set1_epi32(360)), isR);
+
+      // hue table, sign extended
+      t = _mm256_i32gather_epi32((const int *)hueRound, _mm256_add_epi32(
+             _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(255)), 8), d), 1);
+      t = _mm256_srai_epi32(_mm256_slli_epi32(t, 24), 24);
+      hnum = _mm256_add_epi32(_mm256_mullo_epi32(base, d),
+                              _mm256_mullo_epi32(n, _mm256_set1_epi32(60)));
+      lim = _mm256_mullo_epi32(d, ff);
+      fall = _mm256_or_si256(_mm256_cmpeq_epi32(t, _mm256_set1_epi32(HUE_TIE)),
+                             _mm256_andnot_si256(_mm256_cmpeq_epi32(d, zero),
+                                                 _mm256_cmpeq_epi32(hnum, lim)));
+      flag = _mm256_cmpgt_epi32(hnum, lim);
+      h = _mm256_sub_epi32(_mm256_add_epi32(base, t), _mm256_and_si256(flag, ff));
+      v = _mm256_and_si256(_mm256_i32gather_epi32((const int *)valueTab, mx, 1), ff);
+      s = _mm256_and_si256(_mm256_i32gather_epi32((const int *)satTab,
+             _mm256_add_epi32(_mm256_slli_epi32(mx, 8), mn), 1), ff);
+      s = _mm256_or_si256(s, _mm256_and_si256(flag, _mm256_set1_epi32(S_MASK_HIGH)));
+      px = _mm256_or_si256(_mm256_and_si256(h, ff),
+                           _mm256_or_si256(_mm256_slli_epi32(s, 8), _mm256_slli_epi32(v, 16)));
+      _mm256_storeu_si256((__m256i *)out, px);
+      m = _mm256_movemask_ps(_mm256_castsi256_ps(fall));
+      for (k = 0; k < 8; k++) {
+         if (m & (1 << k)) {
+            hsv[i + k] = RGBtoHSV(rgb[i + k]);
+         }
+         else {
+            memcpy(&hsv[i + k], &out[k], sizeof(hsvPixel));
+         }
+      }
+   }
+   return(i);
+}
+
+static int hasAvx2(void) {
+   static int level = -1;
+   if (level < 0) {
+      __builtin_cpu_init();
+      level = __builtin_cpu_supports("avx2");
+   }
+   return(level);
+}
+#endif
+
+/*---------------------------------------------------------------------------
+  This function converts a buffer of RGB pixels to HSV pixels.  The results
+  are exactly those of RGBtoHSV().
+
+   Where:   pixel *rgb           - the pixels to convert
+            hsvPixel *hsv        - receives npix HSV pixels
+            int npix             - number of pixels
+---------------------------------------------------------------------------*/
+void ge_rgb_to_hsv_buf(const pixel *rgb, hsvPixel *hsv, int npix) {
+   int i = 0;
+
+   hsvTables();
+#ifdef GE_X86_SIMD
+   if (hasAvx2()) {
+      i = rgbToHsvAvx2(rgb, hsv, npix);
+   }
+#endif
+   for (; i < npix; i++) {
+      hsv[i] = hsvFromTables(rgb[i]);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function converts a buffer of HSV pixels back to RGB.  It gives the
+  same result as HSVtoRGB() for valid input, but clamps H to 0..360 and S
+  and V to 0..100 instead of exiting.  It is meant for palettes, so each
+  entry uses the scalar formula.
+
+   Where:   hsvPixel *hsv        - the pixels to convert
+            pixel *rgb           - receives n RGB pixels
+            int n                - number of pixels
+---------------------------------------------------------------------------*/
+void ge_hsv_to_rgb_buf(const hsvPixel *hsv, pixel *rgb, int n) {
+   hsvPixel pix;
+   int i, h, s;
+
+   for (i = 0; i < n; i++) {
+      pix = hsv[i];
+      h = pix.h;
+      s = pix.s;
+      if (s > 100) {
+         s &= S_MASK_LOW;
+         h += 255;
+      }
+      s = s > 100 ? 100 : s;
+      if (h > 360) {
+         h = 360;
+      }
+      pix.v = pix.v > 100 ? 100 : pix.v;
+      if (h > 255) {
+         pix.h = h - 255;
+         pix.s = s | S_MASK_HIGH;
+      }
+      else {
+         pix.h = h;
+         pix.s = s;
+      }
+      rgb[i] = HSVtoRGB(pix);
+   }
+}
+
 #ifdef TESTRGB
 //main function
 int main(int argc, char const *argv[]) {
@@ -0,0 +1,376 @@
+/*---------------------------------------------------------------------------
+  Streaming video to GIF.  Raw RGB frames, or a YUV4MPEG2 (Y4M) stream such
+  as "ffmpeg -f yuv4mpegpipe -pix_fmt yuv420p -" writes, are read from a
+  file descriptor one frame at a time, quantized and handed to the encoder,
+  which writes them as rectangles changed since the previous frame.  Only
+  the frame being read and the index images of the current and previous
+  frames are held, so memory does not grow with the length of the video.
+
+----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#include "gifEncDec.h"
+
+#define GS_FPS        (25.0)  // input frame rate when nothing says otherwise
+#define GS_REFRESH    (64)    // default ge_Stream.refresh
+#define GS_SAMPLE     (4)     // 1 of every GS_SAMPLE rows is checked for error
+#define GS_LINE       (256)   // longest Y4M header line kept
+
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* State of one stream. */
+typedef struct {
+   ge_Stream *gs;
+   int fd;
+   int w, h, y4m;
+   size_t frameSize;             // bytes of one input frame
+   uint8_t *frame;               // the frame being read
+   uint8_t *index[2];            // current and previous index images
+   pixel *row;                   // one converted row
+   ge_InvMap *invmap;
+   pixel palette[MAX_PALETTE];   // palette in use
+   int ncolors;
+   long fit;                     // error of the frame the palette was made for
+   ge_GIF *out;
+   pixel gct[MAX_PALETTE];
+   int gctColors;
+} GsState;
+
+
+/*---------------------------------------------------------------------------
+  This function reads exactly n bytes, however the pipe hands them over.
+
+   Returns: 1 when all were read, 0 at the end of the input, -1 when the
+            input ends inside them
+---------------------------------------------------------------------------*/
+static int readFull(int fd, void *buf, size_t n) {
+   size_t got = 0;
+   long r;
+
+   while (got < n) {
+      r = read(fd, (uint8_t *)buf + got, n - got);
+      if (r <= 0) {
+         return(got ? -1 : 0);
+      }
+      got += r;
+   }
+   return(1);
+}
+
+/*---------------------------------------------------------------------------
+  This function reads a Y4M header line up to its newline.  Lines longer
+  than the buffer are cut, which only drops parameters that are ignored.
+
+   Returns: 1 on success, 0 at the end of the input, -1 on a partial line
+---------------------------------------------------------------------------*/
+static int readLine(int fd, char *line, int len) {
+   int n = 0, r;
+   char c;
+
+   while ((r = read(fd, &c, 1)) == 1 && c != '\n') {
+      if (n < len - 1) {
+         line [n++] = c;
+      }
+   }
+   line [n] = 0;
+   if (r != 1) {
+      return(n ? -1 : 0);
+   }
+   return(1);
+}
+
+/*---------------------------------------------------------------------------
+  This function parses the stream header of a Y4M file: the frame size,
+  the frame rate and the chroma layout, which must be 4:2:0.
+
+   Returns: 0 on success, -1 if it is not a Y4M stream the encoder reads
+---------------------------------------------------------------------------*/
+static int readY4mHeader(GsState *st) {
+   char line[GS_LINE], *tok, *save;
+   int num, den;
+
+   if (readLine(st->fd, line, sizeof(line)) <= 0 || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+      return(-1);
+   }
+   for (tok = strtok_r(line + 10, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+      switch (tok [0]) {
+      case 'W':
+         st->w = atoi(tok + 1);
+         break;
+      case 'H':
+         st->h = atoi(tok + 1);
+         break;
+      case 'F':
+         if (!st->gs->fps && sscanf(tok + 1, "%d:%d", &num, &den) == 2 && num > 0 && den > 0) {
+            st->gs->fps = (double)num / den;
+         }
+         break;
+      case 'C':
+         // 420jpeg, 420paldv, 420mpeg2 only differ in chroma siting; deeper
+         // formats such as 420p10 have 16 bit samples
+         if (strcmp(tok + 1, "420") && strcmp(tok + 1, "420jpeg") &&
+             strcmp(tok + 1, "420paldv") && strcmp(tok + 1, "420mpeg2")) {
+            return(-1);
+         }
+         break;
+      }
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function reads the next frame of the stream into st->frame.
+
+   Returns: 1 for a frame, 0 at the end of the stream, -1 for a bad frame
+---------------------------------------------------------------------------*/
+static int readFrame(GsState *st) {
+   char line[GS_LINE];
+   int ret;
+
+   if (st->y4m) {
+      ret = readLine(st->fd, line, sizeof(line));
+      if (ret <= 0) {
+         return(ret);
+      }
+      if (strncmp(line, "FRAME", 5) != 0) {
+         return(-1);
+      }
+   }
+   ret = readFull(st->fd, st->frame, st->frameSize);
+   // A frame cut short ends the stream; the caller sees it as an error
+   if (st->y4m && ret == 0) {
+      ret = -1;
+   }
+   return(ret);
+}
+
+/*---------------------------------------------------------------------------
+  This function measures how well an index image shows its source frame:
+  the mean squared RGB error over 1 of every GS_SAMPLE rows.
+
+   Returns: the error per pixel
+---------------------------------------------------------------------------*/
+static long frameError(GsState *st, const ge_Source *src, const uint8_t *index) {
+   const pixel *pix, *p;
+   long sum = 0, n = 0;
+   int x, y, dr, dg, db;
+
+   for (y = 0; y < st->h; y += GS_SAMPLE) {
+      pix = ge_source_row(src, st->w, y, st->row, NULL);
+      for (x = 0; x < st->w; x++) {
+         p = &st->palette[index[(size_t)y * st->w + x]];
+         dr = pix[x].r - p->r;
+         dg = pix[x].g - p->g;
+         db = pix[x].b - p->b;
+         sum += dr * dr + dg * dg + db * db;
+      }
+      n += st->w;
+   }
+   return(sum / MAX(n, 1));
+}
+
+/*---------------------------------------------------------------------------
+  This function gives a frame its palette indexes.  The frame is mapped to
+  the palette in use, so unchanged areas keep their indexes and only what
+  moved is written.  If that mapping is much worse than it was for the
+  frame the palette was made from, as after a cut, the frame gets a new
+  palette of its own.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int quantizeFrame(GsState *st, const ge_Source *src, uint8_t *index) {
+   ge_Stream *gs = st->gs;
+   ge_QuantOpts opt = gs->quant;
+   int palLen = gs->palLen ? gs->palLen : MAX_PALETTE, last;
+   long limit = 2 * st->fit + (gs->refresh ? gs->refresh : GS_REFRESH);
+
+   opt.invmap = st->invmap;
+   if (st->ncolors) {
+      opt.fixed = 1;
+      if (createGIFsrc(src, index, st->w, st->h, st->palette, st->ncolors, &opt) < 0) {
+         return(-1);
+      }
+      if (frameError(st, src, index) <= limit) {
+         return(0);
+      }
+   }
+   opt.fixed = 0;
+   last = createGIFsrc(src, index, st->w, st->h, st->palette, palLen, &opt);
+   if (last < 0) {
+      return(-1);
+   }
+   st->ncolors = last + 1;
+   st->fit = frameError(st, src, index);
+   gs->palettes++;
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function writes a frame.  The output is opened with the first one,
+  whose palette becomes the global color table; frames on a later palette
+  carry it as a local table.
+
+   Returns: 0 on success, -1 if the output cannot be created
+---------------------------------------------------------------------------*/
+static int encodeFrame(GsState *st, const char *outName, uint8_t *index, uint16_t delay) {
+   ge_Stream *gs = st->gs;
+
+   if (!st->out) {
+      memset(st->gct, 0, sizeof(st->gct));
+      memcpy(st->gct, st->palette, st->ncolors * sizeof(pixel));
+      st->gctColors = st->ncolors;
+      st->out = ge_new_gif_opt(outName, st->w, st->h, (uint8_t *)st->gct, st->ncolors,
+                               gs->loop, &gs->enc);
+      if (!st->out) {
+         return(-1);
+      }
+   }
+   if (st->ncolors == st->gctColors && !memcmp(st->palette, st->gct, st->ncolors * sizeof(pixel))) {
+      ge_add_frame_buf(st->out, index, delay);
+   }
+   else {
+      ge_add_frame_lct(st->out, index, delay, (uint8_t *)st->palette, st->ncolors);
+   }
+   gs->nframes++;
+   return(0);
+}
+
+static double seconds(void) {
+#ifndef _WIN32
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec + ts.tv_nsec * 1e-9);
+#else
+   return((double)clock() / CLOCKS_PER_SEC);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  This function encodes a stream of video frames into a GIF as they
+  arrive.  With gs->width and gs->height set the input is raw packed RGB,
+  otherwise a Y4M stream with 4:2:0 chroma, which the quantizer reads
+  without converting it first.  Frames are dropped evenly to bring
+  gs->fps down to gs->rate, and each frame kept is shown until the time
+  of the next one, rounded to hundredths of a second.
+
+   Where:   int fd               - the input, e.g. 0 for stdin
+            char *outName        - the GIF to write
+            ge_Stream *gs        - settings in, statistics out
+
+   Returns: number of frames written, or negative for error
+
+   Errors:  -1 the input is not a stream of the expected kind, or ends
+               inside a frame (the frames before it are written)
+            -2 out of memory
+            -3 the output cannot be written
+---------------------------------------------------------------------------*/
+int ge_encode_stream(int fd, const char *outName, ge_Stream *gs) {
+   GsState st;
+   ge_Source src;
+   double start = seconds(), rate;
+   long kept = 0, shown = 0, next;
+   int ret, cur = 0;
+#ifndef _WIN32
+   struct rusage ru;
+#endif
+
+   memset(&st, 0, sizeof(st));
+   st.gs = gs;
+   st.fd = fd;
+   gs->frames_in = gs->nframes = gs->palettes = 0;
+   gs->bytes_in = gs->bytes_out = 0;
+   st.w = gs->width;
+   st.h = gs->height;
+   st.y4m = !st.w || !st.h;
+   if (st.y4m && readY4mHeader(&st) < 0) {
+      return(-1);
+   }
+   if (st.w <= 0 || st.h <= 0 || st.w > 0xFFFF || st.h > 0xFFFF) {
+      return(-1);
+   }
+   if (gs->fps <= 0) {
+      gs->fps = GS_FPS;
+   }
+   rate = gs->rate > 0 && gs->rate < gs->fps ? gs->rate : gs->fps;
+
+   memset(&src, 0, sizeof(src));
+   if (st.y4m) {
+      st.frameSize = (size_t)st.w * st.h + 2 * (size_t)((st.w + 1) / 2) * ((st.h + 1) / 2);
+      src.format = GE_FMT_I420;
+   }
+   else {
+      st.frameSize = (size_t)st.w * st.h * sizeof(pixel);
+      src.format = GE_FMT_RGB;
+   }
+   ret = -2;
+   st.frame = malloc(st.frameSize);
+   st.index[0] = malloc((size_t)st.w * st.h);
+   st.index[1] = malloc((size_t)st.w * st.h);
+   st.row = malloc(st.w * sizeof(pixel));
+   st.invmap = ge_invmap_new();
+   if (!st.frame || !st.index[0] || !st.index[1] || !st.row || !st.invmap) {
+      goto done;
+   }
+   src.plane[0] = st.frame;
+   src.plane[1] = st.frame + (size_t)st.w * st.h;
+   src.plane[2] = src.plane[1] + (size_t)((st.w + 1) / 2) * ((st.h + 1) / 2);
+   gs->peak_frames = (long)st.frameSize + 2L * st.w * st.h;
+
+   while ((ret = readFrame(&st)) > 0) {
+      gs->bytes_in += st.frameSize;
+      // Input frame i covers [i, i+1) / fps; keep it if output frame `kept`
+      // is due in that time
+      if (kept * gs->fps >= (gs->frames_in + 1) * rate - 1e-6) {
+         gs->frames_in++;
+         continue;
+      }
+      gs->frames_in++;
+      if (quantizeFrame(&st, &src, st.index[cur]) < 0) {
+         ret = -2;
+         goto done;
+      }
+      kept++;
+      next = lround(100.0 * kept / rate);
+      if (encodeFrame(&st, outName, st.index[cur], (uint16_t)(next - shown)) < 0) {
+         ret = -3;
+         goto done;
+      }
+      shown = next;
+      // The encoder keeps this frame to diff the next one against
+      cur ^= 1;
+   }
+   if (ret == 0) {
+      ret = gs->nframes;
+   }
+
+done:
+   if (st.out) {
+      gs->bytes_out = st.out->nbytes;
+      ge_close_gif(st.out);
+   }
+   free(st.frame);
+   free(st.index[0]);
+   free(st.index[1]);
+   free(st.row);
+   ge_invmap_free(st.invmap);
+   gs->seconds = seconds() - start;
+   gs->peak_rss = 0;
+#ifndef _WIN32
+   if (getrusage(RUSAGE_SELF, &ru) == 0) {
+      gs->peak_rss = ru.ru_maxrss;
+   }
+#endif
+   return(ret);
+}
@@ -0,0 +1,588 @@
+/*---------------------------------------------------------------------------
+  GIF to GIF transcoding.  Every frame of the input is decoded to true
+  color, given a palette and written again with the dirty rectangle
+  encoder.  Decoding, quantizing and encoding each run on a thread of their
+  own, connected by bounded queues, so the three stages overlap while only
+  a fixed number of frames is ever held in memory.
+
+----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/resource.h>
+#endif
+#include "gifEncDec.h"
+
+#define TC_DEPTH      (4)     // default frames queued between two stages
+#define TC_MAX_DEPTH  (64)
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+/* One frame moving down the pipeline. */
+typedef struct {
+   pixel *rgb;                   // rendered canvas
+   uint8_t *index;               // the canvas in palette indexes
+   pixel palette[MAX_PALETTE];   // colors of this frame
+   int ncolors;
+   pixel srcPal[MAX_PALETTE];    // color table the input drew it with
+   int srcColors;
+   uint16_t delay;
+} TcFrame;
+
+/* Bounded FIFO of frames.  Closing it wakes everybody; pops then drain
+   what is left and return NULL. */
+typedef struct {
+#ifndef _WIN32
+   pthread_mutex_t lock;
+   pthread_cond_t ready, room;
+#endif
+   TcFrame *items[2 * TC_MAX_DEPTH + 4];
+   int head, count, cap, closed;
+} TcQueue;
+
+/* State shared by the stages. */
+typedef struct {
+   ge_Transcode *tc;
+   gd_GIF *in;
+   ge_GIF *out;
+   const char *outName;
+   int w, h;
+   int err;                      // the first error, as ge_transcode() returns it
+   int ndecoded, loop, eof;      // decoder side: frames read, loop count
+   TcQueue pool, decoded, mapped;
+   TcFrame *frames;
+   int nframes;
+   uint8_t *frameMem;            // pixels of all frames, when not tc->frames
+   // quantizer state
+   ge_Histogram *palHist;        // colors of the palette in use
+   uint8_t palIndex[MAX_PALETTE];// palette index of each palHist entry
+   ge_InvMap *invmap;
+   pixel palette[MAX_PALETTE];
+   int ncolors;
+   // encoder state
+   pixel gct[MAX_PALETTE];
+   int gctColors;
+   TcFrame *back;                // frame the encoder still diffs against
+} TcState;
+
+
+static void queueInit(TcQueue *q, int cap) {
+   memset(q, 0, sizeof(*q));
+   q->cap = cap;
+#ifndef _WIN32
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->ready, NULL);
+   pthread_cond_init(&q->room, NULL);
+#endif
+}
+
+static void queueDestroy(TcQueue *q) {
+#ifndef _WIN32
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->ready);
+   pthread_cond_destroy(&q->room);
+#else
+   (void)q;
+#endif
+}
+
+/*---------------------------------------------------------------------------
+  These functions move frames through a queue.  A push waits for room and
+  fails once the queue is closed; a pop waits for a frame and returns NULL
+  once the queue is closed and empty.  Without threads nothing ever waits.
+---------------------------------------------------------------------------*/
+static int queuePush(TcQueue *q, TcFrame *f) {
+   int ret = -1;
+
+#ifndef _WIN32
+   pthread_mutex_lock(&q->lock);
+   while (q->count == q->cap && !q->closed) {
+      pthread_cond_wait(&q->room, &q->lock);
+   }
+#endif
+   if (!q->closed && q->count < q->cap) {
+      q->items[(q->head + q->count++) % q->cap] = f;
+      ret = 0;
+#ifndef _WIN32
+      pthread_cond_signal(&q->ready);
+#endif
+   }
+#ifndef _WIN32
+   pthread_mutex_unlock(&q->lock);
+#endif
+   return(ret);
+}
+
+static TcFrame *queuePop(TcQueue *q) {
+   TcFrame *f = NULL;
+
+#ifndef _WIN32
+   pthread_mutex_lock(&q->lock);
+   while (q->count == 0 && !q->closed) {
+      pthread_cond_wait(&q->ready, &q->lock);
+   }
+#endif
+   if (q->count > 0) {
+      f = q->items[q->head];
+      q->head = (q->head + 1) % q->cap;
+      q->count--;
+#ifndef _WIN32
+      pthread_cond_signal(&q->room);
+#endif
+   }
+#ifndef _WIN32
+   pthread_mutex_unlock(&q->lock);
+#endif
+   return(f);
+}
+
+static void queueClose(TcQueue *q) {
+#ifndef _WIN32
+   pthread_mutex_lock(&q->lock);
+#endif
+   q->closed = 1;
+#ifndef _WIN32
+   pthread_cond_broadcast(&q->ready);
+   pthread_cond_broadcast(&q->room);
+   pthread_mutex_unlock(&q->lock);
+#endif
+}
+
+/* Stop every stage after an error, keeping the first one. */
+static void tcAbort(TcState *st, int err) {
+#ifndef _WIN32
+   pthread_mutex_lock(&st->pool.lock);
+#endif
+   if (!st->err) {
+      st->err = err;
+   }
+#ifndef _WIN32
+   pthread_mutex_unlock(&st->pool.lock);
+#endif
+   queueClose(&st->pool);
+   queueClose(&st->decoded);
+   queueClose(&st->mapped);
+}
+
+
+/* The first error so far, read under the lock tcAbort() takes. */
+static int tcError(TcState *st) {
+   int err;
+
+#ifndef _WIN32
+   pthread_mutex_lock(&st->pool.lock);
+#endif
+   err = st->err;
+#ifndef _WIN32
+   pthread_mutex_unlock(&st->pool.lock);
+#endif
+   return(err);
+}
+
+
+/*---------------------------------------------------------------------------
+  Decode stage: renders the next frame of the input into f.  Every image
+  is a frame with its own delay, 0 included.  With tc->merge_zero, images
+  without a delay are merged into the ones after them instead, which
+  undoes the split of a frame into several rectangles by an encoder.
+
+   Returns: 1 for a frame, 0 at the end of the input, -1 on a bad file
+---------------------------------------------------------------------------*/
+static int decodeFrame(TcState *st, TcFrame *f) {
+   int ret, drawn = 0;
+
+   while (!st->eof) {
+      ret = gd_get_frame(st->in);
+      if (ret < 0) {
+         return(-1);
+      }
+      if (ret == 0) {
+         st->eof = 1;
+         break;
+      }
+      gd_render_frame(st->in, (uint8_t *)f->rgb);
+      f->delay = st->in->gce.delay;
+      f->srcColors = st->in->palette->size;
+      memcpy(f->srcPal, st->in->palette->colors, f->srcColors * sizeof(pixel));
+      if (!drawn++ && st->ndecoded++ == 0) {
+         // The loop count comes before the first image
+         st->loop = st->in->has_loop ? st->in->loop_count : -1;
+      }
+      if (f->delay || !st->tc->merge_zero) {
+         break;
+      }
+   }
+   return(drawn > 0);
+}
+
+/*---------------------------------------------------------------------------
+  This function makes a palette the one in use and indexes its colors.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int usePalette(TcState *st, const pixel *palette, int ncolors) {
+   int k, size;
+
+   if (palette != st->palette) {
+      memcpy(st->palette, palette, ncolors * sizeof(pixel));
+   }
+   st->ncolors = ncolors;
+   ge_hist_clear(st->palHist);
+   for (k = 0; k < ncolors; k++) {
+      // A color listed twice keeps its first index
+      size = st->palHist->size;
+      if (ge_hist_insert(st->palHist, (palette[k].r << 16) | (palette[k].g << 8) |
+                         palette[k].b, 1) < 0) {
+         st->ncolors = 0;
+         return(-1);
+      }
+      if (st->palHist->size > size) {
+         st->palIndex[size] = k;
+      }
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  This function maps a frame exactly to the palette in use.
+
+   Returns: 1 if every pixel has its color in the palette, else 0
+---------------------------------------------------------------------------*/
+static int mapExact(TcState *st, TcFrame *f) {
+   int i, j, k, n = st->w * st->h;
+
+   if (!st->ncolors) {
+      return(0);
+   }
+   for (i = 0; i < n; i = j) {
+      k = ge_hist_find(st->palHist, f->rgb[i]);
+      if (k < 0) {
+         return(0);
+      }
+      for (j = i + 1; j < n && !memcmp(&f->rgb[j], &f->rgb[i], sizeof(pixel)); j++)
+         ;
+      memset(&f->index[i], st->palIndex[k], j - i);
+   }
+   return(1);
+}
+
+/*---------------------------------------------------------------------------
+  Quantize stage.  A frame whose colors are all in the palette in use is
+  mapped to it exactly, so the palette and the indexes of unchanged areas
+  stay the same from frame to frame.  Failing that the color table the
+  input drew the frame with is tried, and only then does the frame get a
+  new palette from createGIFex(), which becomes the palette in use.
+
+   Returns: 0 on success, -1 if out of memory
+---------------------------------------------------------------------------*/
+static int quantizeFrame(TcState *st, TcFrame *f) {
+   ge_QuantOpts opt = st->tc->quant;
+   int palLen = st->tc->palLen ? st->tc->palLen : MAX_PALETTE, last;
+
+   if (!mapExact(st, f)) {
+      if (f->srcColors <= palLen && (f->srcColors != st->ncolors ||
+          memcmp(f->srcPal, st->palette, f->srcColors * sizeof(pixel)))) {
+         if (usePalette(st, f->srcPal, f->srcColors) < 0) {
+            return(-1);
+         }
+      }
+      if (!mapExact(st, f)) {
+         opt.invmap = st->invmap;
+         opt.fixed = 0;
+         last = createGIFex(f->rgb, f->index, st->w, st->h, st->palette, palLen, &opt);
+         if (last < 0 || usePalette(st, st->palette, last + 1) < 0) {
+            return(-1);
+         }
+         st->tc->requantized++;
+      }
+   }
+   memcpy(f->palette, st->palette, st->ncolors * sizeof(pixel));
+   f->ncolors = st->ncolors;
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+  Encode stage.  The output is opened with the first frame: its palette
+  becomes the global color table and the loop count of the input is
+  copied.  Later frames with another palette carry it as a local table.
+  The previous frame is handed back to the pool only now, as the encoder
+  diffs against it.
+
+   Returns: 0 on success, -1 if the output cannot be created
+---------------------------------------------------------------------------*/
+static int encodeFrame(TcState *st, TcFrame *f) {
+   ge_Transcode *tc = st->tc;
+   ge_Options enc = tc->enc;
+
+   if (!st->out) {
+      memset(st->gct, 0, sizeof(st->gct));
+      memcpy(st->gct, f->palette, f->ncolors * sizeof(pixel));
+      st->gctColors = f->ncolors;
+      tc->loop = st->loop;
+      enc.memory = enc.memory || !st->outName;
+      st->out = ge_new_gif_opt(st->outName, st->w, st->h, (uint8_t *)st->gct, f->ncolors,
+                               tc->loop, &enc);
+      if (!st->out) {
+         return(-1);
+      }
+   }
+   if (f->ncolors == st->gctColors && !memcmp(f->palette, st->gct, f->ncolors * sizeof(pixel))) {
+      ge_add_frame_buf(st->out, f->index, f->delay);
+   }
+   else {
+      ge_add_frame_lct(st->out, f->index, f->delay, (uint8_t *)f->palette, f->ncolors);
+   }
+   tc->nframes++;
+   if (st->back) {
+      queuePush(&st->pool, st->back);
+   }
+   st->back = f;
+   return(0);
+}
+
+
+#ifndef _WIN32
+static void *decodeStage(void *arg) {
+   TcState *st = arg;
+   TcFrame *f;
+   int ret;
+
+   while ((f = queuePop(&st->pool)) != NULL) {
+      ret = decodeFrame(st, f);
+      if (ret < 0) {
+         tcAbort(st, -1);
+      }
+      if (ret <= 0 || queuePush(&st->decoded, f) < 0) {
+         break;
+      }
+   }
+   queueClose(&st->decoded);
+   return(NULL);
+}
+
+static void *quantizeStage(void *arg) {
+   TcState *st = arg;
+   TcFrame *f;
+
+   while ((f = queuePop(&st->decoded)) != NULL) {
+      if (quantizeFrame(st, f) < 0) {
+         tcAbort(st, -2);
+      }
+      if (queuePush(&st->mapped, f) < 0) {
+         break;
+      }
+   }
+   queueClose(&st->mapped);
+   return(NULL);
+}
+#endif
+
+/*---------------------------------------------------------------------------
+  This function runs the three stages in turn on the calling thread, one
+  frame at a time.
+
+   Returns: nothing, st->err is set for any error
+---------------------------------------------------------------------------*/
+static void runSerial(TcState *st) {
+   TcFrame *f;
+   int ret;
+
+   while (!st->err && (f = queuePop(&st->pool)) != NULL) {
+      ret = decodeFrame(st, f);
+      if (ret <= 0) {
+         if (ret < 0) {
+            st->err = -1;
+         }
+         break;
+      }
+      if (quantizeFrame(st, f) < 0) {
+         st->err = -2;
+      }
+      else if (encodeFrame(st, f) < 0) {
+         st->err = -3;
+      }
+   }
+}
+
+static double seconds(void) {
+#ifndef _WIN32
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec + ts.tv_nsec * 1e-9);
+#else
+   return((double)clock() / CLOCKS_PER_SEC);
+#endif
+}
+
+
+/*---------------------------------------------------------------------------
+  This function transcodes a GIF file into another one.  Every frame is
+  rendered, requantized only when its colors leave the palette in use, and
+  encoded against the previous frame.  Delays and the loop count are kept;
+  disposal is applied while rendering, so the output shows the same frames
+  even though it is written with its own disposal.  The stages run on
+  three threads with tc->depth frames queued between them, or in turn on
+  the calling thread with tc->serial (always on Windows).
+
+   Where:   char *inName         - the GIF to read, unused with tc->data
+            char *outName        - the GIF to write, NULL to return it in
+                                   tc->out
+            ge_Transcode *tc     - settings in, statistics out
+
+   Returns: number of frames written, or negative for error
+
+   Errors:  -1 the input cannot be read or is not a GIF
+            -2 out of memory
+            -3 the output cannot be written
+---------------------------------------------------------------------------*/
+int ge_transcode(const char *inName, const char *outName, ge_Transcode *tc) {
+   TcState st;
+   TcFrame *f;
+   struct stat sb;
+   double start = seconds();
+   uint8_t *mem;
+   size_t npix, need;
+   int i, depth, ret = -2, serial = tc->serial;
+#ifndef _WIN32
+   pthread_t decoder, quantizer;
+   struct rusage ru;
+#else
+   serial = 1;
+#endif
+
+   memset(&st, 0, sizeof(st));
+   st.tc = tc;
+   st.outName = outName;
+   tc->nframes = tc->requantized = 0;
+   tc->loop = -1;
+   tc->out = NULL;
+   tc->outSize = 0;
+   if (tc->data) {
+      tc->bytes_in = tc->size;
+      st.in = gd_open_gif_mem(tc->data, tc->size);
+   }
+   else {
+      tc->bytes_in = stat(inName, &sb) == 0 ? (long)sb.st_size : 0;
+      st.in = gd_open_gif(inName);
+   }
+   if (!st.in) {
+      return(-1);
+   }
+   st.w = st.in->width;
+   st.h = st.in->height;
+
+   // Frames in flight: one per stage, depth in each queue and the previous
+   // frame kept by the encoder
+   depth = tc->depth > 0 ? MIN(tc->depth, TC_MAX_DEPTH) : TC_DEPTH;
+   st.nframes = 2 * depth + 4;
+   if (serial) {
+      // The frame being worked on and the one the encoder diffs against
+      st.nframes = 2;
+   }
+   queueInit(&st.pool, st.nframes);
+   queueInit(&st.decoded, depth);
+   queueInit(&st.mapped, depth);
+   st.frames = calloc(st.nframes, sizeof(TcFrame));
+   st.palHist = ge_hist_new();
+   st.invmap = tc->quant.invmap ? tc->quant.invmap : ge_invmap_new();
+   if (!st.frames || !st.palHist || !st.invmap) {
+      goto done;
+   }
+   // One block for the pixels and indexes of every frame, the caller's
+   // when it keeps them from one call to the next
+   npix = (size_t)st.w * st.h;
+   need = st.nframes * npix * (sizeof(pixel) + 1);
+   if (tc->keep_frames) {
+      if (tc->framesSize < need) {
+         mem = realloc(tc->frames, need);
+         if (!mem) {
+            goto done;
+         }
+         tc->frames = mem;
+         tc->framesSize = need;
+      }
+      mem = tc->frames;
+   }
+   else {
+      mem = st.frameMem = malloc(need);
+      if (!mem) {
+         goto done;
+      }
+   }
+   for (i = 0; i < st.nframes; i++) {
+      f = &st.frames[i];
+      f->rgb = (pixel *)(mem + i * npix * (sizeof(pixel) + 1));
+      f->index = (uint8_t *)(f->rgb + npix);
+      queuePush(&st.pool, f);
+   }
+   tc->peak_frames = (long)st.nframes * (sizeof(TcFrame) + (long)st.w * st.h * 4);
+
+#ifndef _WIN32
+   if (!serial) {
+      if (pthread_create(&decoder, NULL, decodeStage, &st) != 0) {
+         goto done;
+      }
+      if (pthread_create(&quantizer, NULL, quantizeStage, &st) != 0) {
+         tcAbort(&st, -2);
+         pthread_join(decoder, NULL);
+         goto done;
+      }
+      while ((f = queuePop(&st.mapped)) != NULL) {
+         if (!tcError(&st) && encodeFrame(&st, f) < 0) {
+            tcAbort(&st, -3);
+         }
+      }
+      pthread_join(decoder, NULL);
+      pthread_join(quantizer, NULL);
+   }
+   else {
+      runSerial(&st);
+   }
+#else
+   runSerial(&st);
+#endif
+   if (tcError(&st)) {
+      ret = st.err;
+      goto done;
+   }
+   if (!st.out) {
+      // No frames at all
+      ret = -1;
+      goto done;
+   }
+   ret = tc->nframes;
+
+done:
+   if (st.out) {
+      tc->bytes_out = st.out->nbytes;
+      tc->out = ge_close_gif_mem(st.out, &tc->outSize);
+      if (!outName && !tc->out && ret >= 0) {
+         ret = -2;
+      }
+   }
+   free(st.frameMem);
+   free(st.frames);
+   ge_hist_free(st.palHist);
+   if (st.invmap != tc->quant.invmap) {
+      ge_invmap_free(st.invmap);
+   }
+   queueDestroy(&st.pool);
+   queueDestroy(&st.decoded);
+   queueDestroy(&st.mapped);
+   gd_close_gif(st.in);
+   tc->seconds = seconds() - start;
+   tc->peak_rss = 0;
+#ifndef _WIN32
+   if (getrusage(RUSAGE_SELF, &ru) == 0) {
+      tc->peak_rss = ru.ru_maxrss;
+   }
+#endif
+   return(ret);
+}